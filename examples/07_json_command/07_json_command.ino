@@ -0,0 +1,98 @@
+#include <Arduino.h>
+#include <ESPWiFiMqttWrapper.h>
+
+//Code ini support untuk ESP32 dan ESP8266
+//Membutuhkan library PubSubClient
+//https://www.arduino.cc/reference/en/libraries/pubsubclient/
+//Tidak membutuhkan ArduinoJSON, message json dibaca langsung dari buffer MQTT tanpa alokasi memori
+
+ESPWiFiMqttWrapper wrapper;
+
+const char* MQTT_Server		= "iot.a2n.tech";	// server MQTT
+const char* MQTT_username	= "Your User Name"; // your username or api id
+const char* MQTT_password	= "Your Password";	// your mqqtt password of api secret
+
+const char* WiFi_SSID		= "Your WiFi SSID"; // nama wifi anda
+const char* WiFi_Password	= "Your WiFi Password"; // password wifi anda
+const char* WiFi_HostName	= "yourHostName"; // nama host name device ini
+
+//	Anda hanya diperbolehkan publish atau subscribe dengan awalan Topic yang telah ditentukan pada aplikasi
+//	Root topic dapat ditemukan pada halaman utama (Main Dashboard) http://iot.a2n.tech
+//	contoh format topic:
+//	{ROOT_TOPIC}/{SUB_TOPIC}
+const char* MQTT_SUBSCRIBE_TOPIC_COMMAND = "{ROOT_TOPIC}/esp/command";
+const char* MQTT_SUBSCRIBE_TOPIC_CONFIG = "{ROOT_TOPIC}/esp/config";
+
+#if defined(ESP8266)
+uint8_t PIN_DIGITAL_OUTPUT[] = { 4, 5, 12, 13, 15 };
+#elif defined(ESP32)
+uint8_t PIN_DIGITAL_OUTPUT[] = { 4, 5, 13, 15, 16, 17, 18, 19 };
+#endif
+
+// format json { "gpio": 4, "value": 1 }
+const ArJsonField COMMAND_FIELDS[] = {
+	{ "gpio", JSON_FIELD_INT, true },
+	{ "value", JSON_FIELD_INT, true }
+};
+
+bool checkAvailablePin(uint8_t pin) {
+	for (size_t i = 0; i < sizeof(PIN_DIGITAL_OUTPUT); i++) {
+		if (PIN_DIGITAL_OUTPUT[i] == pin)
+			return true;
+	}
+	return false;
+}
+
+void setup() {
+	Serial.begin(115200);
+
+	for (size_t i = 0; i < sizeof(PIN_DIGITAL_OUTPUT); i++)
+		pinMode(PIN_DIGITAL_OUTPUT[i], OUTPUT);
+
+	// enable debugger to Serial
+	wrapper.setDebugger(&Serial);
+
+	wrapper.setWiFi(WiFi_HostName, WiFi_SSID, WiFi_Password);
+	wrapper.setMqttServer(MQTT_Server, MQTT_username, MQTT_password);
+	wrapper.initWiFi();
+
+	// mode deklaratif: handler hanya dipanggil jika semua field wajib ada dan tipenya benar
+	wrapper.setCommand(MQTT_SUBSCRIBE_TOPIC_COMMAND, COMMAND_FIELDS, 2, [&](const ArJsonValue* values) {
+		uint8_t gpio = values[0].asInt;
+		uint8_t value = values[1].asInt;
+		if (checkAvailablePin(gpio))
+			digitalWrite(gpio, value ? HIGH : LOW);
+		else {
+			Serial.print("GPIO :");
+			Serial.print(gpio);
+			Serial.println(" tidak tersedia");
+		}
+	}).setErrorFunction([&](const char* topic, const char* field) {
+		Serial.println("Format data salah !!.. contoh format format json { \"gpio\": 4, \"value\": 1 }");
+	});
+
+	// mode manual: baca field dengan path
+	// contoh message { "interval": 5000, "led": { "color": "red", "on": true } }
+	wrapper.setSubscription(MQTT_SUBSCRIBE_TOPIC_CONFIG, [&](char* topic, uint8_t* payload, unsigned int length) {
+		JsonCommand json;
+		if (!json.parse(payload, length))
+			return;
+		long interval;
+		if (json.getInt("interval", interval)) {
+			Serial.print("Interval: ");
+			Serial.println(interval);
+		}
+		const char* color = json.getString("led.color");
+		bool on;
+		if (color && json.getBool("led.on", on)) {
+			Serial.print("LED ");
+			Serial.print(color);
+			Serial.println(on ? " ON" : " OFF");
+		}
+	});
+
+	wrapper.initMqtt();
+}
+void loop() {
+	wrapper.loop();
+}
@@ -0,0 +1,70 @@
+ //------------------------------------------------------------------
+ // Copyright(c) 2022-2024 a2n Technology
+ // Anwar Minarso (anwar.minarso@gmail.com)
+ // https://github.com/anwarminarso/
+ // This file is part of the a2n ESPWiFiMqttWrapper v1.0.6
+ //
+ // This library is free software; you can redistribute it and/or
+ // modify it under the terms of the GNU Lesser General Public
+ // License as published by the Free Software Foundation; either
+ // version 2.1 of the License, or (at your option) any later version.
+ //
+ // This library is distributed in the hope that it will be useful,
+ // but WITHOUT ANY WARRANTY; without even the implied warranty of
+ // MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the GNU
+ // Lesser General Public License for more details
+ //------------------------------------------------------------------
+
+
+// Just enough of the Arduino core to run the host tests and benchmarks
+#ifndef Arduino_H
+#define Arduino_H
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <functional>
+#include <string>
+#include <thread>
+
+#define memcpy_P memcpy
+
+inline unsigned long millis() {
+	static const auto start = std::chrono::steady_clock::now();
+	return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+}
+inline void delay(unsigned long ms) {
+	std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+class String {
+private:
+	std::string _text;
+public:
+	String(const char* text = "") : _text(text) {}
+	String& operator=(const char* text) {
+		_text = text;
+		return *this;
+	}
+	unsigned int length() const {
+		return _text.size();
+	}
+	const char* c_str() const {
+		return _text.c_str();
+	}
+};
+
+class Print {
+public:
+	virtual ~Print() {}
+	virtual size_t write(uint8_t b) = 0;
+	virtual size_t write(const uint8_t* buffer, size_t size) {
+		size_t n = 0;
+		while (size-- && write(*buffer++))
+			n++;
+		return n;
+	}
+};
+#endif
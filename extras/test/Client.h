@@ -0,0 +1,31 @@
+ //------------------------------------------------------------------
+ // Copyright(c) 2022-2024 a2n Technology
+ // Anwar Minarso (anwar.minarso@gmail.com)
+ // https://github.com/anwarminarso/
+ // This file is part of the a2n ESPWiFiMqttWrapper v1.0.6
+ //
+ // This library is free software; you can redistribute it and/or
+ // modify it under the terms of the GNU Lesser General Public
+ // License as published by the Free Software Foundation; either
+ // version 2.1 of the License, or (at your option) any later version.
+ //
+ // This library is distributed in the hope that it will be useful,
+ // but WITHOUT ANY WARRANTY; without even the implied warranty of
+ // MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the GNU
+ // Lesser General Public License for more details
+ //------------------------------------------------------------------
+
+#ifndef Client_H
+#define Client_H
+
+#include <Arduino.h>
+
+class Client : public Print {
+public:
+	virtual int connect(const char* host, uint16_t port) = 0;
+	virtual int available() = 0;
+	virtual int read() = 0;
+	virtual void stop() = 0;
+	virtual uint8_t connected() = 0;
+};
+#endif
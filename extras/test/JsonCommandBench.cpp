@@ -0,0 +1,161 @@
+ //------------------------------------------------------------------
+ // Copyright(c) 2022-2024 a2n Technology
+ // Anwar Minarso (anwar.minarso@gmail.com)
+ // https://github.com/anwarminarso/
+ // This file is part of the a2n ESPWiFiMqttWrapper v1.0.6
+ //
+ // This library is free software; you can redistribute it and/or
+ // modify it under the terms of the GNU Lesser General Public
+ // License as published by the Free Software Foundation; either
+ // version 2.1 of the License, or (at your option) any later version.
+ //
+ // This library is distributed in the hope that it will be useful,
+ // but WITHOUT ANY WARRANTY; without even the implied warranty of
+ // MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the GNU
+ // Lesser General Public License for more details
+ //------------------------------------------------------------------
+
+
+// Host benchmark of JsonCommand against the usual String copy + ArduinoJson JsonDocument handler.
+// Run with: make -C extras/test bench ARDUINOJSON=<path to ArduinoJson/src>
+// Without ArduinoJson only the JsonCommand figures are printed.
+
+#include <chrono>
+#include <cstdio>
+#include <new>
+#include <string>
+#include "JsonCommand.h"
+
+#if defined(__has_include)
+#if __has_include(<ArduinoJson.h>)
+#include <ArduinoJson.h>
+#define BENCH_ARDUINOJSON
+#endif
+#endif
+
+// every heap allocation made while a message is handled is counted
+static size_t allocations = 0;
+static size_t allocatedBytes = 0;
+void* operator new(size_t size) {
+	allocations++;
+	allocatedBytes += size;
+	void* p = malloc(size);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+void operator delete(void* p) noexcept {
+	free(p);
+}
+void operator delete(void* p, size_t) noexcept {
+	free(p);
+}
+
+static const int ITERATIONS = 200000;
+static volatile long sink = 0;
+
+struct Command {
+	const char* name;
+	const char* payload;
+	const ArJsonField* fields;
+	size_t fieldCount;
+};
+
+static const ArJsonField GPIO_FIELDS[] = {
+	{ "gpio", JSON_FIELD_INT, true },
+	{ "value", JSON_FIELD_INT, true }
+};
+static const ArJsonField LED_FIELDS[] = {
+	{ "led.color", JSON_FIELD_STRING, true },
+	{ "led.brightness", JSON_FIELD_INT, true },
+	{ "fade", JSON_FIELD_INT, false }
+};
+static const ArJsonField THERMOSTAT_FIELDS[] = {
+	{ "mode", JSON_FIELD_STRING, true },
+	{ "setpoint", JSON_FIELD_FLOAT, true },
+	{ "hysteresis", JSON_FIELD_FLOAT, false },
+	{ "schedule.0", JSON_FIELD_INT, false },
+	{ "schedule.1", JSON_FIELD_INT, false },
+	{ "label", JSON_FIELD_STRING, false }
+};
+static const Command COMMANDS[] = {
+	{ "gpio", "{\"gpio\":4,\"value\":1}", GPIO_FIELDS, 2 },
+	{ "led", "{\"led\":{\"color\":\"red\",\"brightness\":128},\"fade\":250}", LED_FIELDS, 3 },
+	{ "thermostat", "{\"mode\":\"auto\",\"setpoint\":21.5,\"hysteresis\":0.5,\"schedule\":[6,22],\"label\":\"living \\\"room\\\"\"}", THERMOSTAT_FIELDS, 6 }
+};
+
+// the payload is handed over as the MQTT callback does: a shared, not null terminated buffer
+static bool handleJsonCommand(const Command& command, const uint8_t* payload, unsigned int length) {
+	JsonCommand json;
+	ArJsonValue values[6];
+	if (!json.parse(payload, length) || json.bind(command.fields, command.fieldCount, values))
+		return false;
+	for (size_t i = 0; i < command.fieldCount; i++)
+		sink += values[i].asInt + (values[i].asString ? values[i].asString[0] : 0);
+	return true;
+}
+
+#ifdef BENCH_ARDUINOJSON
+static bool handleArduinoJson(const Command& command, const uint8_t* payload, unsigned int length) {
+	// what a setSubscription(topic, ArSubscribeMessageHandlerFunction) handler receives
+	std::string message;
+	for (unsigned int i = 0; i < length; i++)
+		message += (char)payload[i];
+	JsonDocument doc;
+	if (deserializeJson(doc, message))
+		return false;
+	for (size_t i = 0; i < command.fieldCount; i++) {
+		JsonVariant value = doc.as<JsonVariant>();
+		char path[32];
+		strncpy(path, command.fields[i].path, sizeof(path) - 1);
+		path[sizeof(path) - 1] = '\0';
+		for (char* segment = strtok(path, "."); segment; segment = strtok(nullptr, ".")) {
+			if (value.is<JsonArray>())
+				value = value[atoi(segment)];
+			else
+				value = value[(const char*)segment];
+		}
+		if (command.fields[i].required && value.isNull())
+			return false;
+		if (command.fields[i].type == JSON_FIELD_STRING) {
+			const char* text = value.as<const char*>();
+			sink += text ? text[0] : 0;
+		}
+		else {
+			sink += value.as<long>();
+		}
+	}
+	return true;
+}
+#endif
+
+template <typename Handler>
+static void run(const char* parser, const Command& command, Handler handler) {
+	const uint8_t* payload = (const uint8_t*)command.payload;
+	unsigned int length = strlen(command.payload);
+	if (!handler(command, payload, length)) {
+		printf("%-12s %-12s FAILED\n", command.name, parser);
+		return;
+	}
+	allocations = allocatedBytes = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < ITERATIONS; i++)
+		handler(command, payload, length);
+	auto elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+	printf("%-12s %-12s %9.1f ns/msg %7.2f allocs/msg %8.1f heap bytes/msg\n", command.name, parser,
+		elapsed / ITERATIONS, (double)allocations / ITERATIONS, (double)allocatedBytes / ITERATIONS);
+}
+
+int main() {
+	printf("JsonCommand reader: %u bytes on the stack\n", (unsigned)sizeof(JsonCommand));
+	for (const Command& command : COMMANDS) {
+		run("JsonCommand", command, handleJsonCommand);
+#ifdef BENCH_ARDUINOJSON
+		run("ArduinoJson", command, handleArduinoJson);
+#endif
+	}
+#ifndef BENCH_ARDUINOJSON
+	printf("ArduinoJson.h not found, pass ARDUINOJSON=<path to ArduinoJson/src> to compare\n");
+#endif
+	return 0;
+}
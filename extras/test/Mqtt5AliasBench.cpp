@@ -0,0 +1,111 @@
+ //------------------------------------------------------------------
+ // Copyright(c) 2022-2024 a2n Technology
+ // Anwar Minarso (anwar.minarso@gmail.com)
+ // https://github.com/anwarminarso/
+ // This file is part of the a2n ESPWiFiMqttWrapper v1.0.6
+ //
+ // This library is free software; you can redistribute it and/or
+ // modify it under the terms of the GNU Lesser General Public
+ // License as published by the Free Software Foundation; either
+ // version 2.1 of the License, or (at your option) any later version.
+ //
+ // This library is distributed in the hope that it will be useful,
+ // but WITHOUT ANY WARRANTY; without even the implied warranty of
+ // MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the GNU
+ // Lesser General Public License for more details
+ //------------------------------------------------------------------
+
+// Host benchmark of MQTT 5 topic aliases: Mqtt5Client publishes the same telemetry to a local
+// stand-in broker once with and once without aliases and the bytes on the wire are compared.
+// Run with: make -C extras/test bench
+
+#include <cstdio>
+#include <deque>
+#include "Mqtt5Client.h"
+
+// Scripted broker: answers CONNECT with a CONNACK and counts every byte the client sends
+class StandInBroker : public Client {
+private:
+	std::deque<uint8_t> _toClient;
+	bool _connected = false;
+public:
+	size_t received = 0;
+	int connect(const char*, uint16_t) override {
+		// CONNACK: session not present, success, Topic Alias Maximum 8, Receive Maximum 10
+		static const uint8_t connack[] = { 0x20, 0x09, 0x00, 0x00, 0x06, 0x22, 0x00, 0x08, 0x21, 0x00, 0x0A };
+		_toClient.assign(connack, connack + sizeof(connack));
+		_connected = true;
+		received = 0;
+		return 1;
+	}
+	size_t write(uint8_t b) override {
+		return write(&b, 1);
+	}
+	size_t write(const uint8_t*, size_t size) override {
+		received += size;
+		return size;
+	}
+	int available() override {
+		return _toClient.size();
+	}
+	int read() override {
+		if (_toClient.empty())
+			return -1;
+		uint8_t b = _toClient.front();
+		_toClient.pop_front();
+		return b;
+	}
+	void stop() override {
+		_connected = false;
+	}
+	uint8_t connected() override {
+		return _connected;
+	}
+};
+
+static const char* TOPICS[] = {
+	"home/livingroom/sensor/temperature",
+	"home/livingroom/sensor/humidity",
+	"devices/ESP32-A1B2C3D4E5F6/telemetry/rssi",
+	"a2n/iot/ESP8266-0123456789AB/status"
+};
+static const size_t TOPIC_COUNT = sizeof(TOPICS) / sizeof(TOPICS[0]);
+static const int MESSAGES = 1000;
+static const char PAYLOAD[] = "21.5";
+
+static size_t publishAll(bool useAlias, uint32_t expiry, ArMqtt5Stats& stats) {
+	StandInBroker broker;
+	Mqtt5Client client;
+	client.setClient(broker).setServer("localhost", 1883);
+	client.setMessageExpiry(expiry);
+	if (!client.connect("bench", nullptr, nullptr)) {
+		printf("CONNECT failed, state %d\n", client.state());
+		exit(1);
+	}
+	broker.received = 0;
+	for (int i = 0; i < MESSAGES; i++)
+		client.publish(TOPICS[i % TOPIC_COUNT], (const uint8_t*)PAYLOAD, strlen(PAYLOAD), false, 0, useAlias);
+	stats = client.getStats();
+	return broker.received;
+}
+
+int main() {
+	printf("%d QoS 0 messages, %u topics, %u byte payload\n", MESSAGES, (unsigned)TOPIC_COUNT, (unsigned)strlen(PAYLOAD));
+	int failures = 0;
+	const uint32_t expiries[] = { 0, 60 };
+	for (uint32_t expiry : expiries) {
+		ArMqtt5Stats plainStats, aliasStats;
+		size_t plain = publishAll(false, expiry, plainStats);
+		size_t aliased = publishAll(true, expiry, aliasStats);
+		printf("message expiry %-3u without aliases %6.2f bytes/msg, with aliases %6.2f bytes/msg, saved %5.2f bytes/msg (%.1f%%)\n",
+			expiry, (double)plain / MESSAGES, (double)aliased / MESSAGES, (double)(plain - aliased) / MESSAGES,
+			100.0 * (plain - aliased) / plain);
+		// what the device reports must match what the broker saw
+		if (aliasStats.aliasBytesSaved != plain - aliased || aliasStats.aliasedMessages != MESSAGES - TOPIC_COUNT) {
+			printf("getStats() reports %u bytes saved in %u aliased messages, the broker saw %u\n",
+				aliasStats.aliasBytesSaved, aliasStats.aliasedMessages, (unsigned)(plain - aliased));
+			failures++;
+		}
+	}
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,217 @@
+ //------------------------------------------------------------------
+ // Copyright(c) 2022-2024 a2n Technology
+ // Anwar Minarso (anwar.minarso@gmail.com)
+ // https://github.com/anwarminarso/
+ // This file is part of the a2n ESPWiFiMqttWrapper v1.0.6
+ //
+ // This library is free software; you can redistribute it and/or
+ // modify it under the terms of the GNU Lesser General Public
+ // License as published by the Free Software Foundation; either
+ // version 2.1 of the License, or (at your option) any later version.
+ //
+ // This library is distributed in the hope that it will be useful,
+ // but WITHOUT ANY WARRANTY; without even the implied warranty of
+ // MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the GNU
+ // Lesser General Public License for more details
+ //------------------------------------------------------------------
+
+// Host test of TransmitQueue against a socket with a small send buffer, run with: make -C extras/test
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "TransmitQueue.h"
+
+static int failures = 0;
+#define CHECK(condition) do { if (!(condition)) { printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); failures++; } } while (0)
+
+// Accepts at most window bytes per write() call, like a nearly full TCP send buffer
+class ShimSocket : public Print {
+public:
+	std::string sent;
+	size_t window;
+	ShimSocket(size_t window) : window(window) {}
+	size_t write(uint8_t b) override {
+		return write(&b, 1);
+	}
+	size_t write(const uint8_t* buffer, size_t size) override {
+		if (size > window)
+			size = window;
+		sent.append((const char*)buffer, size);
+		return size;
+	}
+};
+
+// QoS 0 PUBLISH exactly as the broker must see it
+static std::string encode(const char* topic, const char* payload) {
+	std::string packet;
+	size_t topicLength = strlen(topic);
+	packet += (char)0x30;
+	packet += (char)(2 + topicLength + strlen(payload));
+	packet += (char)0;
+	packet += (char)topicLength;
+	packet += topic;
+	packet += payload;
+	return packet;
+}
+static ArPublishResult enqueue(TransmitQueue& queue, const char* topic, const char* payload) {
+	return queue.enqueue(topic, (const uint8_t*)payload, strlen(payload), false);
+}
+
+static void testPartialWritesAcrossWrapAround() {
+	TransmitQueue queue;
+	CHECK(queue.begin(40));
+	ShimSocket socket(3);
+	std::string expected;
+	// 20 byte packets in a 40 byte ring: from the second round on every packet wraps
+	for (int i = 0; i < 10; i++) {
+		char payload[16];
+		snprintf(payload, sizeof(payload), "payload-%02d", i);
+		CHECK(enqueue(queue, "t/abcd", payload) == PUBLISH_QUEUED);
+		expected += encode("t/abcd", payload);
+		// drain a little per loop(), leaving a half written packet most of the time
+		CHECK(queue.drain(socket, 7) <= 7);
+		while (queue.used() > 20)
+			queue.drain(socket, 5);
+	}
+	while (queue.used() > 0)
+		CHECK(queue.drain(socket, 1000) > 0);
+	CHECK(queue.isIdle());
+	CHECK(socket.sent == expected);
+	CHECK(queue.dropped() == 0);
+}
+
+static void testDiscardPartial() {
+	TransmitQueue queue;
+	CHECK(queue.begin(64));
+	ShimSocket socket(4);
+	CHECK(enqueue(queue, "a", "first") == PUBLISH_QUEUED);
+	CHECK(enqueue(queue, "b", "second") == PUBLISH_QUEUED);
+	CHECK(queue.drain(socket, 100) == 4);
+	CHECK(!queue.isIdle());
+
+	// reconnect: the rest of the first packet is useless, the second one is sent whole
+	queue.discardPartial();
+	CHECK(queue.isIdle());
+	CHECK(queue.dropped() == 1);
+	socket.sent.clear();
+	socket.window = 100;
+	queue.drain(socket, 100);
+	CHECK(socket.sent == encode("b", "second"));
+	CHECK(queue.used() == 0);
+
+	// nothing half written, nothing to discard
+	queue.discardPartial();
+	CHECK(queue.dropped() == 1);
+}
+
+static void testHighWaterHysteresis() {
+	TransmitQueue queue;
+	CHECK(queue.begin(100));
+	std::vector<bool> events;
+	queue.setHighWaterMark(40, [&](bool above, size_t used, size_t capacity) {
+		events.push_back(above);
+		CHECK(capacity == 100);
+		CHECK(above ? used >= 40 : used < 20);
+	});
+	ShimSocket socket(100);
+	// 12 byte packets
+	CHECK(enqueue(queue, "t", "1234567") == PUBLISH_QUEUED);
+	CHECK(enqueue(queue, "t", "1234567") == PUBLISH_QUEUED);
+	CHECK(enqueue(queue, "t", "1234567") == PUBLISH_QUEUED);
+	CHECK(events.empty());
+	CHECK(enqueue(queue, "t", "1234567") == PUBLISH_QUEUED);	// 48 bytes
+	CHECK(events.size() == 1 && events[0]);
+	CHECK(enqueue(queue, "t", "1234567") == PUBLISH_QUEUED);	// still above, no repeat
+	CHECK(events.size() == 1);
+
+	// below the mark but not below half of it: still reported as above
+	queue.drain(socket, 36);	// 24 bytes left
+	CHECK(events.size() == 1);
+	CHECK(enqueue(queue, "t", "1234567") == PUBLISH_QUEUED);	// 36 bytes
+	CHECK(events.size() == 1);
+	queue.drain(socket, 24);	// 12 bytes left
+	CHECK(events.size() == 2 && !events[1]);
+	queue.drain(socket, 12);
+	CHECK(events.size() == 2);
+}
+
+static void testWouldBlockAndDroppedBoundaries() {
+	TransmitQueue disabled;
+	CHECK(enqueue(disabled, "t", "x") == PUBLISH_DROPPED);
+
+	TransmitQueue queue;
+	CHECK(queue.begin(20));
+	ShimSocket socket(100);
+	// exactly the capacity fits an empty queue
+	CHECK(enqueue(queue, "t", "123456789012345") == PUBLISH_QUEUED);
+	CHECK(queue.used() == 20);
+	// one more byte can never fit
+	CHECK(enqueue(queue, "t", "1234567890123456") == PUBLISH_DROPPED);
+	CHECK(queue.dropped() == 1);
+	// fits, but not right now; the queue is left untouched
+	CHECK(enqueue(queue, "t", "") == PUBLISH_WOULD_BLOCK);
+	CHECK(queue.used() == 20);
+	CHECK(queue.dropped() == 1);
+
+	queue.drain(socket, 5);	// 15 used, 5 free
+	CHECK(enqueue(queue, "t", "x") == PUBLISH_WOULD_BLOCK);	// 6 bytes
+	CHECK(enqueue(queue, "t", "") == PUBLISH_QUEUED);		// 5 bytes, exactly the free space
+	CHECK(queue.used() == 20);
+	queue.drain(socket, 100);
+	CHECK(socket.sent == encode("t", "123456789012345") + encode("t", ""));
+
+	// MQTT 5 properties are limited to one length byte
+	uint8_t properties[128] = {};
+	CHECK(queue.enqueue("t", (const uint8_t*)"x", 1, false, false, properties, 128) == PUBLISH_DROPPED);
+	CHECK(queue.enqueue("t", (const uint8_t*)"x", 1, false, false, properties, 3) == PUBLISH_QUEUED);
+	CHECK(queue.used() == 10);
+}
+
+static void testDiscardAliased() {
+	TransmitQueue queue;
+	CHECK(queue.begin(64));
+	ShimSocket socket(100);
+	const uint8_t expiry[] = { 0x02, 0, 0, 0, 60 };
+	const uint8_t alias[] = { 0x23, 0, 1 };
+	const uint8_t both[] = { 0x02, 0, 0, 0, 60, 0x23, 0, 2 };
+	// move the ring so the kept packets have to wrap while compacting
+	CHECK(queue.enqueue("t", (const uint8_t*)"012345678901234567890123456789012345678901234", 45, false, false, expiry, 0) == PUBLISH_QUEUED);
+	queue.drain(socket, 100);
+	socket.sent.clear();
+
+	CHECK(queue.enqueue("a", (const uint8_t*)"1", 1, false, false, expiry, 0) == PUBLISH_QUEUED);		// 7 bytes, kept
+	CHECK(queue.enqueue("b", (const uint8_t*)"2", 1, false, false, alias, 3) == PUBLISH_QUEUED);		// defines alias 1
+	CHECK(queue.enqueue("", (const uint8_t*)"3", 1, false, false, alias, 3) == PUBLISH_QUEUED);		// uses alias 1
+	CHECK(queue.enqueue("c", (const uint8_t*)"4", 1, false, false, expiry, 5) == PUBLISH_QUEUED);		// 12 bytes, kept
+	CHECK(queue.enqueue("d", (const uint8_t*)"5", 1, false, false, both, 8) == PUBLISH_QUEUED);
+	CHECK(queue.enqueue("e", (const uint8_t*)"6", 1, false, false, expiry, 0) == PUBLISH_QUEUED);		// 7 bytes, kept
+	queue.discardAliased();
+	CHECK(queue.dropped() == 3);
+	CHECK(queue.used() == 26);
+	queue.drain(socket, 100);
+	std::string expected;
+	expected += std::string("\x30\x05\x00\x01" "a" "\x00" "1", 7);
+	expected += std::string("\x30\x0A\x00\x01" "c" "\x05\x02\x00\x00\x00\x3C" "4", 12);
+	expected += std::string("\x30\x05\x00\x01" "e" "\x00" "6", 7);
+	CHECK(socket.sent == expected);
+	// the queue keeps working after compacting
+	CHECK(queue.enqueue("f", (const uint8_t*)"7", 1, false) == PUBLISH_QUEUED);
+	socket.sent.clear();
+	queue.drain(socket, 100);
+	CHECK(socket.sent == encode("f", "7"));
+}
+
+int main() {
+	testPartialWritesAcrossWrapAround();
+	testDiscardPartial();
+	testHighWaterHysteresis();
+	testWouldBlockAndDroppedBoundaries();
+	testDiscardAliased();
+	if (failures) {
+		printf("%d check(s) failed\n", failures);
+		return 1;
+	}
+	printf("TransmitQueue: all tests passed\n");
+	return 0;
+}
@@ -29,9 +29,14 @@ String getWifiMacAddress() {
 
 ESPWiFiMqttWrapper::ESPWiFiMqttWrapper() :
 	_subscribehandlers(ListOf<SubscribeHandler*>([](SubscribeHandler* h) { delete h; })),
-	_publishHandlers(ListOf<PublishHandler*>([](PublishHandler* h) { delete h; }))
+	_publishHandlers(ListOf<PublishHandler*>([](PublishHandler* h) { delete h; })),
+	_cacheFilters(ListOf<const char*>(nullptr)),
+	_subscriptions(ListOf<Subscription*>([](Subscription* s) { delete s; }))
 {
 }
+ESPWiFiMqttWrapper::~ESPWiFiMqttWrapper() {
+	delete _mqtt5Client;
+}
 
 void ESPWiFiMqttWrapper::setWiFi(const char* HostName, const char* SSID, const char* Password) {
 	this->_wifiHostName = HostName;
@@ -72,18 +77,15 @@ void ESPWiFiMqttWrapper::setCertificate(const X509List* certificate, const Priva
 #if defined(ESP8266)
 void ESPWiFiMqttWrapper::setClock() {
 	configTime(3 * 3600, 0, "pool.ntp.org", "time.nist.gov");
-	this->print("Waiting for NTP time sync: ");
+	WRAPPER_LOGI("Waiting for NTP time sync");
 	time_t now = time(nullptr);
 	while (now < 8 * 3600 * 2) {
 		delay(500);
-		this->print(".");
 		now = time(nullptr);
 	}
-	this->println("");
 	struct tm timeinfo;
 	gmtime_r(&now, &timeinfo);
-	this->print("Current time (UTC): ");
-	this->print(asctime(&timeinfo));
+	WRAPPER_LOGI("Current time (UTC): %s", asctime(&timeinfo));
 }
 #endif
 void ESPWiFiMqttWrapper::initWiFi() {
@@ -99,24 +101,42 @@ void ESPWiFiMqttWrapper::initWiFi() {
 	delay(500);
 	if (!WiFi.setHostname(this->_wifiHostName))
 	{
-		this->print("Failure to set hostname. Current Hostname : ");
-		this->println(WiFi.getHostname());
+		WRAPPER_LOGW("Failure to set hostname. Current Hostname : %s", WiFi.getHostname());
 	}
 #endif
 	WiFi.mode(WIFI_STA);
+#if defined(ESP32)
+	if (_powerProfileSet && _powerProfile == POWER_LOW) {
+		// the listen interval is only read while associating, and WiFi.begin(ssid, pass) resets it:
+		// configure the station ourselves and connect with that configuration
+		wifi_config_t conf;
+		memset(&conf, 0, sizeof(conf));
+		strncpy((char*)conf.sta.ssid, this->_wifiSSID, sizeof(conf.sta.ssid));
+		if (this->_wifiPass)
+			strncpy((char*)conf.sta.password, this->_wifiPass, sizeof(conf.sta.password));
+		conf.sta.listen_interval = POWER_LOW_LISTEN_INTERVAL;
+		esp_wifi_set_config(WIFI_IF_STA, &conf);
+		WiFi.begin();
+	}
+	else {
+		WiFi.begin(this->_wifiSSID, this->_wifiPass);
+	}
+#else
 	WiFi.begin(this->_wifiSSID, this->_wifiPass);
-	this->print("Connecting to WiFi ..");
+#endif
+	WRAPPER_LOGI("Connecting to WiFi %s", this->_wifiSSID);
 	while (WiFi.status() != WL_CONNECTED) {
-		this->print('.');
 		_reconnectWifiCount++;
+		WRAPPER_LOGD("Waiting for WiFi, attempt %d", _reconnectWifiCount);
 		if (_reconnectWifiCount >= (_maxReconnect + 1)) {
 			ESP.restart();
 		}
 		delay(1000);
 	}
-	this->print("Connected. IP Address: ");
-	this->println(WiFi.localIP());
+	WRAPPER_LOGI("Connected. IP Address: %u.%u.%u.%u", WiFi.localIP()[0], WiFi.localIP()[1], WiFi.localIP()[2], WiFi.localIP()[3]);
 	_reconnectWifiCount = 0;
+	if (_powerProfileSet)
+		applyPowerProfile();
 #if defined(ESP8266)
 	if (_useSecureWiFi) {
 		setClock();
@@ -159,6 +179,8 @@ void ESPWiFiMqttWrapper::setMqttServer() {
 	else {
 		_mqttClient.setClient(_defaultClient);
 	}
+	if (_mqtt5Client)
+		_mqtt5Client->setClient(activeClient());
 	if (this->_mqttClientId && !this->_mqttClientId[0]) {
 #if defined(ESP8266)
 		String clientId = "ESP8266-";
@@ -170,9 +192,39 @@ void ESPWiFiMqttWrapper::setMqttServer() {
 		char* clientIdChars = (char*)malloc(str_len);
 		clientId.toCharArray(clientIdChars, str_len);
 		_mqttClientId = clientIdChars;
-		this->println(_mqttClientId);
+		WRAPPER_LOGD("MQTT Client Id: %s", _mqttClientId);
 	}
 	_mqttClient.setServer(_mqttServer, _mqttPort);
+	if (_mqtt5Client)
+		_mqtt5Client->setServer(_mqttServer, _mqttPort);
+}
+void ESPWiFiMqttWrapper::useMqtt5(bool value) {
+	_useMqtt5 = value;
+	if (!value) {
+		delete _mqtt5Client;
+		_mqtt5Client = nullptr;
+		return;
+	}
+	if (_mqtt5Client)
+		return;
+	// allocated on demand, MQTT 3.1.1 users do not pay for its buffers
+	_mqtt5Client = new Mqtt5Client();
+	_mqtt5Client->setClient(activeClient());
+	_mqtt5Client->setServer(_mqttServer, _mqttPort);
+	_mqtt5Client->setCallback(mqttCallback());
+	_mqtt5Client->setMessageExpiry(_messageExpiry);
+}
+void ESPWiFiMqttWrapper::setMessageExpiry(uint32_t seconds) {
+	_messageExpiry = seconds;
+	if (_mqtt5Client)
+		_mqtt5Client->setMessageExpiry(seconds);
+}
+ArMqtt5Stats ESPWiFiMqttWrapper::getMqtt5Stats() {
+	if (_mqtt5Client)
+		return _mqtt5Client->getStats();
+	ArMqtt5Stats stats;
+	memset(&stats, 0, sizeof(stats));
+	return stats;
 }
 
 SubscribeHandler& ESPWiFiMqttWrapper::setSubscription(const char* topicFilter, ArSubscribeHandlerFunction func) {
@@ -189,6 +241,14 @@ SubscribeHandler& ESPWiFiMqttWrapper::setSubscription(const char* topicFilter, A
 	this->addSubscribeHandler(handler);
 	return *handler;
 }
+CommandHandler& ESPWiFiMqttWrapper::setCommand(const char* topicFilter, const ArJsonField* fields, size_t fieldCount, ArCommandHandlerFunction func) {
+	CommandHandler* handler = new CommandHandler();
+	handler->setTopicFilter(topicFilter);
+	handler->setFields(fields, fieldCount);
+	handler->setFunction(func);
+	this->addSubscribeHandler(handler);
+	return *handler;
+}
 PublishHandler& ESPWiFiMqttWrapper::setPublisher(const char* topic, int interval, ArPublishHandlerFunction func) {
 	PublishHandler* handler = new PublishHandler();
 	handler->setTopic(topic);
@@ -206,71 +266,317 @@ PublishHandler& ESPWiFiMqttWrapper::setPublisher(const char* topic, int interval
 	this->addPublishHandler(handler);
 	return *handler;
 }
+AggregatePublishHandler& ESPWiFiMqttWrapper::setAggregatePublisher(const char* topic, int interval, int sampleInterval, size_t windowSize, ArSampleFunction func) {
+	AggregatePublishHandler* handler = new AggregatePublishHandler(windowSize);
+	handler->setTopic(topic);
+	handler->setInterval(interval);
+	handler->setSampleInterval(sampleInterval);
+	handler->setSampleFunction(func);
+	this->addPublishHandler(handler);
+	return *handler;
+}
 void ESPWiFiMqttWrapper::removePublisher(const char* topic) {
-	this->_publishHandlers.remove_first([topic](PublishHandler* h) {
-		return h->isTopicEqual(topic);
+	this->_publishHandlers.remove_first([this, topic](PublishHandler* h) {
+		if (!h->isTopicEqual(topic))
+			return false;
+		if (_mqtt5Client)
+			_mqtt5Client->releaseAlias(h->getTopic());
+		return true;
 	});
 }
 void ESPWiFiMqttWrapper::removeSubscription(const char* topicFilter) {
-	this->_subscribehandlers.remove_first([topicFilter](SubscribeHandler* h) {
-		return h->canHandle(topicFilter);
+	bool removed = this->_subscribehandlers.remove_first([topicFilter](SubscribeHandler* h) {
+		return h->isTopicFilterEqual(topicFilter);
 	});
+	if (removed)
+		releaseSubscription(topicFilter);
+}
+Subscription* ESPWiFiMqttWrapper::findSubscription(const char* topicFilter) {
+	for (const auto& s : _subscriptions) {
+		if (strcmp(s->topicFilter, topicFilter) == 0)
+			return s;
+	}
+	return nullptr;
+}
+ArSubscriptionStatus ESPWiFiMqttWrapper::getSubscriptionStatus(const char* topicFilter) {
+	Subscription* subscription = findSubscription(topicFilter);
+	if (!subscription)
+		return SUBSCRIPTION_REMOVED;
+	return subscription->status;
+}
+void ESPWiFiMqttWrapper::setSubscriptionStatus(Subscription* subscription, ArSubscriptionStatus status) {
+	if (subscription->status == status)
+		return;
+	subscription->status = status;
+	if (_onSubscriptionStatus)
+		_onSubscriptionStatus(subscription->topicFilter, status);
+}
+void ESPWiFiMqttWrapper::acquireSubscription(const char* topicFilter) {
+	Subscription* subscription = findSubscription(topicFilter);
+	if (!subscription) {
+		subscription = new Subscription(topicFilter);
+		_subscriptions.add(subscription);
+	}
+	subscription->refs++;
+	// UNSUBSCRIBE was not sent yet, the broker still has it
+	if (subscription->status == SUBSCRIPTION_UNSUBSCRIBING)
+		setSubscriptionStatus(subscription, SUBSCRIPTION_SENT);
+}
+void ESPWiFiMqttWrapper::releaseSubscription(const char* topicFilter) {
+	Subscription* subscription = findSubscription(topicFilter);
+	if (!subscription || subscription->refs == 0)
+		return;
+	if (--subscription->refs > 0)
+		return;
+	if (subscription->status == SUBSCRIPTION_SENT) {
+		setSubscriptionStatus(subscription, SUBSCRIPTION_UNSUBSCRIBING);
+	}
+	else {
+		// the broker never saw it
+		setSubscriptionStatus(subscription, SUBSCRIPTION_REMOVED);
+		_subscriptions.remove(subscription);
+	}
+}
+// Writes the pending filters as batched SUBSCRIBE or UNSUBSCRIBE packets, false if a write failed
+bool ESPWiFiMqttWrapper::sendSubscriptions(bool subscribe) {
+	ArSubscriptionStatus wanted = subscribe ? SUBSCRIPTION_PENDING : SUBSCRIPTION_UNSUBSCRIBING;
+	// 5 bytes reserved for the fixed header, written in front of the packet identifier
+	uint8_t packet[SUBSCRIPTION_BATCH_SIZE + 5];
+	bool more = true;
+	while (more) {
+		more = false;
+		size_t length = 7;
+		if (_useMqtt5)
+			packet[length++] = 0; // no properties
+		// packet identifier (and MQTT 5 properties) come before the first filter
+		const size_t headerLength = length;
+		size_t count = 0;
+		for (const auto& s : _subscriptions) {
+			if (s->status != wanted)
+				continue;
+			size_t filterLength = strlen(s->topicFilter);
+			size_t entryLength = 2 + filterLength + (subscribe ? 1 : 0);
+			if (headerLength - 5 + entryLength > SUBSCRIPTION_BATCH_SIZE) {
+				WRAPPER_LOGE("Topic filter too long: %s", s->topicFilter);
+				setSubscriptionStatus(s, SUBSCRIPTION_FAILED);
+				continue;
+			}
+			if (length + entryLength > SUBSCRIPTION_BATCH_SIZE + 5) {
+				more = true;
+				break;
+			}
+			packet[length++] = filterLength >> 8;
+			packet[length++] = filterLength & 0xFF;
+			memcpy(packet + length, s->topicFilter, filterLength);
+			length += filterLength;
+			if (subscribe)
+				packet[length++] = 0; // QoS 0
+			count++;
+		}
+		if (count == 0)
+			return true;
+
+		if (++_subscribePacketId == 0)
+			_subscribePacketId = 0x8000;
+		packet[5] = _subscribePacketId >> 8;
+		packet[6] = _subscribePacketId & 0xFF;
+		size_t remaining = length - 5;
+		size_t start = 5;
+		uint8_t lengthBytes[4];
+		size_t lengthCount = 0;
+		do {
+			uint8_t encoded = remaining & 0x7F;
+			remaining >>= 7;
+			if (remaining > 0)
+				encoded |= 0x80;
+			lengthBytes[lengthCount++] = encoded;
+		} while (remaining > 0);
+		while (lengthCount > 0)
+			packet[--start] = lengthBytes[--lengthCount];
+		packet[--start] = subscribe ? 0x82 : 0xA2;
+
+		// through PubSubClient so it counts as outgoing traffic
+		if (mqttWriter().write(packet + start, length - start) != length - start)
+			return false;
+		_lastOutTraffic = millis();
+
+		for (auto it = _subscriptions.begin(); count > 0 && it != _subscriptions.end();) {
+			Subscription* s = *it;
+			++it;
+			if (s->status != wanted)
+				continue;
+			count--;
+			if (subscribe) {
+				WRAPPER_LOGI("Subscribing to %s", s->topicFilter);
+				setSubscriptionStatus(s, SUBSCRIPTION_SENT);
+			}
+			else {
+				WRAPPER_LOGI("Unsubscribing from %s", s->topicFilter);
+				setSubscriptionStatus(s, SUBSCRIPTION_REMOVED);
+				_subscriptions.remove(s);
+			}
+		}
+	}
+	return true;
+}
+void ESPWiFiMqttWrapper::flushSubscriptions() {
+	if (!mqttConnected())
+		return;
+	if (sendSubscriptions(true))
+		sendSubscriptions(false);
+}
+void ESPWiFiMqttWrapper::cacheSubscription(const char* topicFilter) {
+	for (const auto& filter : _cacheFilters) {
+		if (strcmp(filter, topicFilter) == 0)
+			return;
+	}
+	_cacheFilters.add(topicFilter);
+	// the cache holds its own reference, removeSubscription() never releases it
+	acquireSubscription(topicFilter);
+	// subscribe again when it is already live, the broker then sends the retained messages to fill the cache
+	Subscription* subscription = findSubscription(topicFilter);
+	if (subscription->status == SUBSCRIPTION_SENT)
+		setSubscriptionStatus(subscription, SUBSCRIPTION_PENDING);
 }
 void ESPWiFiMqttWrapper::initMqtt() {
-	_mqttClient.setCallback([&](char* topic, uint8_t* payload, unsigned int length) {
+	_mqttClient.setCallback(mqttCallback());
+	if (_mqtt5Client)
+		_mqtt5Client->setCallback(mqttCallback());
+}
+Mqtt5Client::CallbackFunction ESPWiFiMqttWrapper::mqttCallback() {
+	return [this](char* topic, uint8_t* payload, unsigned int length) {
+		if (_cache.isEnabled()) {
+			for (const auto& filter : _cacheFilters) {
+				if (topicMatches(filter, topic)) {
+					_cache.update(topic, payload, length);
+					break;
+				}
+			}
+		}
 		for (const auto& h : _subscribehandlers) {
 			if (h->canHandle(topic)) {
 				h->handleFunction(topic, payload, length);
 			}
 		}
-	});
+	};
+}
+bool ESPWiFiMqttWrapper::mqttConnected() {
+	if (_useMqtt5)
+		return _mqtt5Client->connected();
+	return _mqttClient.connected();
+}
+int ESPWiFiMqttWrapper::mqttState() {
+	if (_useMqtt5)
+		return _mqtt5Client->state();
+	return _mqttClient.state();
+}
+void ESPWiFiMqttWrapper::mqttSetKeepAlive(uint16_t keepAlive) {
+	if (_useMqtt5)
+		_mqtt5Client->setKeepAlive(keepAlive);
+	else
+		_mqttClient.setKeepAlive(keepAlive);
+}
+Print& ESPWiFiMqttWrapper::mqttWriter() {
+	if (_useMqtt5)
+		return *_mqtt5Client;
+	return _mqttClient;
 }
 bool ESPWiFiMqttWrapper::connectMqtt() {
 	bool result = false;
-	if (!_mqttClient.connected()) {
+	if (!mqttConnected()) {
+		if (_mqttWasConnected) {
+			_mqttWasConnected = false;
+			if (mqttState() == MQTT_CONNECTION_TIMEOUT) {
+				// missed PINGRESP, the link (or a NAT on the way) does not survive this long idle
+				_pingTimeouts++;
+				if (_keepAliveMin) {
+					_keepAliveCeiling = _appliedKeepAlive / 2;
+					if (_keepAliveCeiling < _connectionKeepAliveMin)
+						_keepAliveCeiling = _connectionKeepAliveMin;
+					WRAPPER_LOGW("PINGRESP missed, keepalive limited to %u s", _keepAliveCeiling);
+				}
+			}
+		}
 		if (millis() - _lastReconnect < 1000)
 			return result;
 		_reconnectMqttCount++;
 		_lastReconnect = millis();
 		if (_reconnectMqttCount > _maxReconnect) {
-			this->println("Restart ESP...");
+			WRAPPER_LOGE("Restart ESP...");
 			ESP.restart();
 		}
 		if (_useSecureWiFi) {
-			this->print("Attempting MQTT secure connection: ");
+			WRAPPER_LOGI("Attempting MQTT secure connection");
 		}
 		else {
-			this->print("Attempting MQTT connection: ");
+			WRAPPER_LOGI("Attempting MQTT connection");
+		}
+		if (_keepAliveMin) {
+			// CONNECT carries the upper bound, pinging more often than that is always allowed
+			mqttSetKeepAlive(_keepAliveMax);
 		}
 		// Attempt to connect
-		if (_mqttClient.connect(_mqttClientId, _mqttUsername, _mqttPassword)) {
-			this->print("Connected, MQTT Client Id: ");
-			this->println(_mqttClientId);
+		bool connected;
+		if (_useMqtt5)
+			connected = _mqtt5Client->connect(_mqttClientId, _mqttUsername, _mqttPassword);
+		else
+			connected = _mqttClient.connect(_mqttClientId, _mqttUsername, _mqttPassword);
+		if (connected) {
+			WRAPPER_LOGI("Connected, MQTT Client Id: %s", _mqttClientId);
+			_mqttWasConnected = true;
+			_connectionKeepAliveMin = _keepAliveMin;
+			_connectionKeepAliveMax = _keepAliveMax;
+			int32_t serverKeepAlive = _useMqtt5 ? _mqtt5Client->getServerKeepAlive() : -1;
+			if (_keepAliveMin && serverKeepAlive > 0 && serverKeepAlive < _keepAliveMax) {
+				// MQTT 5 broker overrode the keepalive, never ping less often than it asks on this connection
+				_connectionKeepAliveMax = serverKeepAlive;
+				if (_connectionKeepAliveMin > _connectionKeepAliveMax)
+					_connectionKeepAliveMin = _connectionKeepAliveMax;
+				WRAPPER_LOGW("Broker limits keepalive to %u s", _connectionKeepAliveMax);
+			}
+			if (_keepAliveCeiling > _connectionKeepAliveMax)
+				_keepAliveCeiling = _connectionKeepAliveMax;
+			_keepAlive = _connectionKeepAliveMin;
+			_appliedKeepAlive = _connectionKeepAliveMax;
+			_keepAliveSince = millis();
 
-			for (const auto& h : _subscribehandlers) {
-				this->print("Subscribing to ");
-				this->println(h->getTopicFilter());
-				_mqttClient.subscribe(h->getTopicFilter());
+			if (_useMqtt5) {
+				// queued packets may use topic aliases of the previous connection
+				_txQueue.discardAliased();
+			}
+			else {
+				_txQueue.discardPartial();
+			}
+			// clean session, the broker has forgotten every subscription
+			for (auto it = _subscriptions.begin(); it != _subscriptions.end();) {
+				Subscription* s = *it;
+				++it;
+				if (s->refs == 0) {
+					setSubscriptionStatus(s, SUBSCRIPTION_REMOVED);
+					_subscriptions.remove(s);
+				}
+				else if (s->status != SUBSCRIPTION_FAILED) {
+					setSubscriptionStatus(s, SUBSCRIPTION_PENDING);
+				}
 			}
+			flushSubscriptions();
 			_reconnectMqttCount = 0;
 			result = true;
 		}
 		else {
-			this->print("Failed, Reason Code=");
-			this->print(String(_mqttClient.state()));
-			this->println();
+			WRAPPER_LOGE("MQTT connection failed, Reason Code=%d", mqttState());
 #if defined(ESP32) || defined(ESP8266)
 			if (_useSecureWiFi) {
 				char buf[80];
 #if defined(ESP32)
 				int error = _secureClient.lastError(buf, sizeof(buf));
 				if (error) {
-					this->println("SSL Error: " + String(error) + ", " + buf);
+					WRAPPER_LOGE("SSL Error: %d, %s", error, buf);
 				}
 #elif defined(ESP8266)
 				int sslError = _secureClient.getLastSSLError(buf, sizeof(buf));
 				if (sslError) {
-					this->println("SSL Error: " + String(sslError) + ", " + buf);
+					WRAPPER_LOGE("SSL Error: %d, %s", sslError, buf);
 				}
 #endif
 #endif
@@ -285,8 +591,7 @@ bool ESPWiFiMqttWrapper::connectWiFi() {
 	bool result = false;
 	if (WiFi.status() == WL_CONNECTED) {
 		if (_reconnectWifiCount > 0) {
-			this->print("Connected. IP Address: ");
-			this->println(WiFi.localIP());
+			WRAPPER_LOGI("Connected. IP Address: %u.%u.%u.%u", WiFi.localIP()[0], WiFi.localIP()[1], WiFi.localIP()[2], WiFi.localIP()[3]);
 		}
 		_reconnectWifiCount = 0;
 		result = true;
@@ -297,35 +602,255 @@ bool ESPWiFiMqttWrapper::connectWiFi() {
 		_reconnectWifiCount++;
 		_lastReconnect = millis();
 		if (_reconnectWifiCount > _maxReconnect) {
-			this->println("Restart ESP...");
+			WRAPPER_LOGE("Restart ESP...");
 			ESP.restart();
 		}
 		else {
 			if (_reconnectWifiCount == 1) {
-				this->print("Attempting WiFi connection...");
+				WRAPPER_LOGI("Attempting WiFi connection...");
 				WiFi.reconnect();
 			}
 			else {
-				this->print(".");
+				WRAPPER_LOGD("Waiting for WiFi, attempt %d", _reconnectWifiCount);
 			}
 		}
 	}
 	return result;
 }
+void ESPWiFiMqttWrapper::log(const char* format, ...) {
+	if (!_debug)
+		return;
+	char buf[ESPWIFIMQTT_LOG_LINE];
+	va_list args;
+	va_start(args, format);
+	int len = vsnprintf_P(buf, sizeof(buf), format, args);
+	va_end(args);
+	if (len <= 0)
+		return;
+	if (len >= (int)sizeof(buf)) {
+		// truncated, keep the line ending
+		len = sizeof(buf) - 1;
+		buf[len - 2] = '\r';
+		buf[len - 1] = '\n';
+	}
+	if (_logBuffer.isEnabled())
+		_logBuffer.write(buf, len);
+	else if (_debugger)
+		_debugger->write((const uint8_t*)buf, len);
+}
+size_t ESPWiFiMqttWrapper::flushLog(size_t maxBytes) {
+	if (!_debugger)
+		return 0;
+	return _logBuffer.drain(*_debugger, maxBytes);
+}
+size_t ESPWiFiMqttWrapper::flushLog(Print& out, size_t maxBytes) {
+	return _logBuffer.drain(out, maxBytes);
+}
+ArPublishResult ESPWiFiMqttWrapper::enqueue(const char* topic, const uint8_t* payload, unsigned int plength, bool retained, bool progmem, bool useAlias) {
+	if (!_txQueue.isEnabled()) {
+		bool sent;
+		if (_useMqtt5)
+			sent = _mqtt5Client->publish(topic, payload, plength, retained, 0, useAlias, progmem);
+		else if (progmem)
+			sent = _mqttClient.publish_P(topic, payload, plength, retained);
+		else
+			sent = _mqttClient.publish(topic, payload, plength, retained);
+		if (!sent)
+			return PUBLISH_DROPPED;
+		_lastOutTraffic = millis();
+		return PUBLISH_SENT;
+	}
+	if (!_useMqtt5)
+		return _txQueue.enqueue(topic, payload, plength, retained, progmem);
+
+	bool isNew = false;
+	uint16_t alias = 0;
+	if (useAlias && _mqtt5Client->connected())
+		alias = _mqtt5Client->prepareAlias(topic, isNew);
+	uint8_t properties[8];
+	size_t propertiesLength = _mqtt5Client->buildPublishProperties(alias, properties);
+	ArPublishResult result = _txQueue.enqueue((alias && !isNew) ? "" : topic, payload, plength, retained, progmem, properties, propertiesLength);
+	if (result == PUBLISH_QUEUED)
+		_mqtt5Client->commitAlias(topic, alias, isNew);
+	return result;
+}
+ArPublishResult ESPWiFiMqttWrapper::publishQos1(const char* topic, const uint8_t* payload, unsigned int plength, boolean retained) {
+	if (!_useMqtt5 || !_mqtt5Client->connected())
+		return PUBLISH_DROPPED;
+	// Receive Maximum of the broker reached, wait for PUBACKs
+	if (!_mqtt5Client->canPublishQos1())
+		return PUBLISH_WOULD_BLOCK;
+	// never between the bytes of a half written queued packet
+	if (!_txQueue.isIdle())
+		return PUBLISH_WOULD_BLOCK;
+	if (!_mqtt5Client->publish(topic, payload, plength, retained, 1))
+		return PUBLISH_DROPPED;
+	_lastOutTraffic = millis();
+	return PUBLISH_SENT;
+}
+void ESPWiFiMqttWrapper::flushTransmitQueue() {
+	if (!_txQueue.isEnabled() || !_txQueue.used() || !mqttConnected())
+		return;
+	int room = activeClient().availableForWrite();
+#if defined(ESP32)
+	// arduino-esp32 clients do not report free socket space, write a bounded chunk instead
+	if (room <= 0)
+		room = TRANSMIT_QUEUE_CHUNK;
+#endif
+	if (room <= 0)
+		return;
+	// write through the MQTT client so it sees the outgoing traffic and skips needless PINGREQs
+	if (_txQueue.drain(mqttWriter(), room) > 0)
+		_lastOutTraffic = millis();
+}
+void ESPWiFiMqttWrapper::setAdaptiveKeepAlive(uint16_t minSeconds, uint16_t maxSeconds) {
+	if (minSeconds == 0)
+		minSeconds = 1;
+	if (maxSeconds < minSeconds)
+		maxSeconds = minSeconds;
+	_keepAliveMin = minSeconds;
+	_keepAliveMax = maxSeconds;
+	_keepAliveCeiling = maxSeconds;
+	_keepAlive = minSeconds;
+	_connectionKeepAliveMin = minSeconds;
+	_connectionKeepAliveMax = maxSeconds;
+	// takes effect on the next connect, the broker only learns the keepalive from CONNECT
+}
+void ESPWiFiMqttWrapper::setPowerProfile(ArPowerProfile profile) {
+	_powerProfile = profile;
+	_powerProfileSet = true;
+	switch (profile) {
+	case POWER_PERFORMANCE:
+		setAdaptiveKeepAlive(15, 60);
+		break;
+	case POWER_BALANCED:
+		setAdaptiveKeepAlive(30, 300);
+		break;
+	case POWER_LOW:
+		setAdaptiveKeepAlive(60, 1200);
+		break;
+	}
+	if (WiFi.status() == WL_CONNECTED)
+		applyPowerProfile();
+}
+void ESPWiFiMqttWrapper::applyPowerProfile() {
+#if defined(ESP8266)
+	switch (_powerProfile) {
+	case POWER_PERFORMANCE:
+		WiFi.setSleepMode(WIFI_NONE_SLEEP);
+		break;
+	case POWER_BALANCED:
+		WiFi.setSleepMode(WIFI_MODEM_SLEEP);
+		break;
+	case POWER_LOW:
+		WiFi.setSleepMode(WIFI_LIGHT_SLEEP, POWER_LOW_LISTEN_INTERVAL);
+		break;
+	}
+#elif defined(ESP32)
+	// automatic light sleep needs a power management enabled IDF build, use the deepest modem sleep instead
+	switch (_powerProfile) {
+	case POWER_PERFORMANCE:
+		WiFi.setSleep(WIFI_PS_NONE);
+		break;
+	case POWER_BALANCED:
+		WiFi.setSleep(WIFI_PS_MIN_MODEM);
+		break;
+	case POWER_LOW: {
+		WiFi.setSleep(WIFI_PS_MAX_MODEM);
+		// used from the next association, initWiFi() sets it before the first one
+		wifi_config_t conf;
+		if (esp_wifi_get_config(WIFI_IF_STA, &conf) == ESP_OK) {
+			conf.sta.listen_interval = POWER_LOW_LISTEN_INTERVAL;
+			esp_wifi_set_config(WIFI_IF_STA, &conf);
+		}
+		break;
+	}
+	}
+#endif
+	WRAPPER_LOGI("Power profile %d", (int)_powerProfile);
+}
+void ESPWiFiMqttWrapper::updateKeepAlive(uint32_t now) {
+	if (!_keepAliveMin)
+		return;
+	uint32_t interval = (uint32_t)_keepAlive * 1000;
+	if (now - _keepAliveSince >= 2 * interval) {
+		// two full intervals without losing the connection
+		_keepAliveSince = now;
+		if (_keepAlive < _keepAliveCeiling) {
+			_keepAlive = _keepAlive * 2 < _keepAliveCeiling ? _keepAlive * 2 : _keepAliveCeiling;
+		}
+		else if (_keepAliveCeiling < _connectionKeepAliveMax) {
+			// healthy at the limit a missed PINGRESP set, probe a longer interval again
+			_keepAliveCeiling = _keepAliveCeiling * 2 < _connectionKeepAliveMax ? _keepAliveCeiling * 2 : _connectionKeepAliveMax;
+		}
+	}
+	// the broker only needs to hear from us, recent outgoing messages make a PINGREQ pointless
+	uint16_t keepAlive = now - _lastOutTraffic < interval ? _connectionKeepAliveMax : _keepAlive;
+	if (keepAlive != _appliedKeepAlive) {
+		_appliedKeepAlive = keepAlive;
+		mqttSetKeepAlive(keepAlive);
+	}
+}
+ArPowerStats ESPWiFiMqttWrapper::getPowerStats() {
+	// typical average current of the radio idling in each profile, in mA
+#if defined(ESP8266)
+	static const float idleCurrent[] = { 70.0f, 17.0f, 3.0f };
+#elif defined(ESP32)
+	static const float idleCurrent[] = { 110.0f, 40.0f, 25.0f };
+#endif
+	// average wait for the next beacon the modem wakes up for (102.4 ms beacon interval)
+	static const uint32_t beaconLatency[] = { 0, 51, 51 * POWER_LOW_LISTEN_INTERVAL };
+
+	ArPowerStats stats;
+	stats.profile = _powerProfile;
+	stats.keepAlive = _keepAliveMin ? _appliedKeepAlive : MQTT_KEEPALIVE;
+	stats.negotiatedKeepAlive = _keepAliveMin ? (_connectionKeepAliveMax ? _connectionKeepAliveMax : _keepAliveMax) : MQTT_KEEPALIVE;
+	stats.pingTimeouts = _pingTimeouts;
+	stats.loopInterval = _loopInterval;
+	// a PINGREQ / PINGRESP exchange keeps the radio fully on for about 100 ms at ~100 mA
+	stats.estimatedCurrent = idleCurrent[_powerProfile] + 10.0f / (stats.keepAlive ? stats.keepAlive : 1);
+	stats.estimatedLatency = beaconLatency[_powerProfile] + _loopInterval / 2;
+	return stats;
+}
 bool ESPWiFiMqttWrapper::loop() {
+	uint32_t loopStart = millis();
+	if (_lastLoop) {
+		// moving average over ~16 calls
+		_loopInterval = (_loopInterval * 15 + (loopStart - _lastLoop)) / 16;
+	}
+	_lastLoop = loopStart;
+	if (_logBuffer.used() && _debugger) {
+		// only what the stream accepts without blocking
+		int room = _debugger->availableForWrite();
+		if (room > 0)
+			_logBuffer.drain(*_debugger, room);
+	}
 	if (!connectWiFi())
 		return false;
 	if (!connectMqtt())
 		return false;
-	_mqttClient.loop();
+	flushTransmitQueue();
+	// PubSubClient may send a PINGREQ from loop(), never put it in the middle of a queued packet
+	updateKeepAlive(millis());
+	if (_txQueue.isIdle()) {
+		flushSubscriptions();
+		if (_useMqtt5)
+			_mqtt5Client->loop();
+		else
+			_mqttClient.loop();
+	}
 	for (const auto& h : _publishHandlers) {
 		now = millis();
+		h->poll(now);
 		if (h->canHandle(now)) {
 			const char* message = h->handleFunction();
 			if (message != nullptr) {
-				_mqttClient.publish(h->getTopic(), message);
+				if (enqueue(h->getTopic(), (const uint8_t*)message, strlen(message), false, false, true) == PUBLISH_WOULD_BLOCK) {
+					WRAPPER_LOGW("Transmit queue full, skipped %s", h->getTopic());
+				}
 			}
 		}
 	}
+	flushTransmitQueue();
 	return true;
 }
\ No newline at end of file
@@ -29,13 +29,55 @@
 #elif defined(ESP32)
 #include <WiFi.h>
 #include <WiFiClientSecure.h>
+#include <esp_wifi.h>
 #else
 #error "This library only supports boards with ESP8266 or ESP32"
 #endif
 
+#include "TransmitQueue.h"
+#include "WrapperLog.h"
+#include "TopicFilter.h"
+#include "LastValueCache.h"
+#include "JsonCommand.h"
+#include "Mqtt5Client.h"
+
 typedef std::function<void(char*, uint8_t*, unsigned int)> ArSubscribeHandlerFunction;
 typedef std::function<void(const char*)> ArSubscribeMessageHandlerFunction;
 typedef std::function<String()> ArPublishHandlerFunction;
+typedef std::function<float()> ArSampleFunction;
+typedef std::function<void(const ArJsonValue*)> ArCommandHandlerFunction;
+// param1: topic, param2: path of the missing / invalid field, nullptr when the message is not valid json
+typedef std::function<void(const char*, const char*)> ArCommandErrorFunction;
+
+enum ArSubscriptionStatus {
+	SUBSCRIPTION_PENDING = 0,	// SUBSCRIBE will be sent on the next loop() while connected
+	SUBSCRIPTION_SENT,			// SUBSCRIBE written to the broker (PubSubClient does not pass SUBACK on)
+	SUBSCRIPTION_FAILED,		// filter does not fit in a SUBSCRIBE packet
+	SUBSCRIPTION_UNSUBSCRIBING,	// no handler left, UNSUBSCRIBE will be sent on the next loop()
+	SUBSCRIPTION_REMOVED		// not subscribed
+};
+typedef std::function<void(const char*, ArSubscriptionStatus)> ArSubscriptionStatusFunction;
+
+enum ArPowerProfile {
+	POWER_PERFORMANCE = 0,	// radio always on, keepalive 15..60 s
+	POWER_BALANCED,			// modem sleep between DTIM beacons, keepalive 30..300 s
+	POWER_LOW				// deepest modem / light sleep with a longer listen interval, keepalive 60..1200 s
+};
+
+// Listen interval (in beacon intervals) used by POWER_LOW
+#ifndef POWER_LOW_LISTEN_INTERVAL
+#define POWER_LOW_LISTEN_INTERVAL 3
+#endif
+
+struct ArPowerStats {
+	ArPowerProfile profile;
+	uint16_t keepAlive;				// current ping interval in seconds
+	uint16_t negotiatedKeepAlive;	// keepalive sent in CONNECT in seconds
+	uint32_t pingTimeouts;			// connections dropped because a PINGRESP never came
+	uint32_t loopInterval;			// average time between loop() calls in ms
+	float estimatedCurrent;			// average current in mA, estimated from typical figures of the profile
+	uint32_t estimatedLatency;		// average extra delay of an inbound command in ms, estimated
+};
 
 template <typename T>
 class ListOfNode {
@@ -192,6 +234,7 @@ protected:
 	ArSubscribeMessageHandlerFunction _func1;
 	ArSubscribeHandlerFunction _func2;
 public:
+	virtual ~SubscribeHandler() {}
 	const char* getTopicFilter() {
 		return _topicFilter;
 	}
@@ -199,9 +242,12 @@ public:
 	void setFunction(ArSubscribeMessageHandlerFunction func) { _func1 = func; }
 	void setFunction(ArSubscribeHandlerFunction func) { _func2 = func; }
 	bool canHandle(const char* topic) {
-		return strcmp(topic, _topicFilter) == 0;
+		return topicMatches(_topicFilter, topic);
 	}
-	void handleFunction(char* topic, uint8_t* payload, unsigned int length) {
+	bool isTopicFilterEqual(const char* topicFilter) {
+		return strcmp(topicFilter, _topicFilter) == 0;
+	}
+	virtual void handleFunction(char* topic, uint8_t* payload, unsigned int length) {
 		if (_func1) {
 			String message;
 			for (int i = 0; i < length; i++)
@@ -213,6 +259,51 @@ public:
 	}
 };
 
+// Parses JSON commands in place and calls the handler with the typed values of a field schema.
+// The MQTT buffer is shared with other handlers of the same topic and is never modified, string
+// values are decoded into the parser and only valid during the call.
+// The schema array must stay alive as long as the handler.
+class CommandHandler : public SubscribeHandler {
+protected:
+	const ArJsonField* _fields = nullptr;
+	size_t _fieldCount = 0;
+	ArCommandHandlerFunction _command;
+	ArCommandErrorFunction _error;
+	ArJsonValue* _values = nullptr;
+public:
+	~CommandHandler() {
+		delete[] _values;
+	}
+	// one value per field is allocated here, never while handling a message
+	void setFields(const ArJsonField* fields, size_t fieldCount) {
+		delete[] _values;
+		_fields = fields;
+		_fieldCount = fieldCount;
+		_values = fieldCount ? new ArJsonValue[fieldCount] : nullptr;
+	}
+	void setFunction(ArCommandHandlerFunction func) { _command = func; }
+	CommandHandler& setErrorFunction(ArCommandErrorFunction func) {
+		_error = func;
+		return *this;
+	}
+	void handleFunction(char* topic, uint8_t* payload, unsigned int length) override {
+		JsonCommand command;
+		if (!command.parse(payload, length)) {
+			if (_error)
+				_error(topic, nullptr);
+			return;
+		}
+		const char* invalid = command.bind(_fields, _fieldCount, _values);
+		if (invalid) {
+			if (_error)
+				_error(topic, invalid);
+			return;
+		}
+		if (_command)
+			_command(_values);
+	}
+};
+
 class PublishHandler {
 protected:
 	const char* _topic;
@@ -221,7 +312,9 @@ protected:
 	long _delta = 0;
 	uint32_t _lastMillis = 0;
 	ArPublishHandlerFunction _func;
+	String _message;
 public:
+	virtual ~PublishHandler() {}
 	void setTopic(const char* topic) { _topic = topic; }
 	const char* getTopic() {
 		return _topic;
@@ -240,19 +333,164 @@ public:
 		_delta = now - _lastMillis;
 		return _interval <= _delta;
 	}
-	const char * handleFunction(void) {
-		char* result = nullptr;
+	// called on every loop(), between publishes
+	virtual void poll(uint32_t /*now*/) {}
+	// returned message stays valid until the next call
+	virtual const char * handleFunction(void) {
+		const char* result = nullptr;
 		if (_func) {
-			String val = _func();
-			int str_len = val.length() + 1;
-			result = (char*)malloc(str_len);
-			val.toCharArray(result, str_len);
+			_message = _func();
+			result = _message.c_str();
 		}
 		_lastMillis = millis();
 		return result;
 	}
 };
 
+// Largest SUBSCRIBE / UNSUBSCRIBE packet body, more filters are split over several packets
+#ifndef SUBSCRIPTION_BATCH_SIZE
+#define SUBSCRIPTION_BATCH_SIZE 256
+#endif
+
+// One distinct topic filter as the broker sees it, shared by every handler using it
+class Subscription {
+public:
+	const char* topicFilter;
+	uint16_t refs;
+	ArSubscriptionStatus status;
+	Subscription(const char* filter) : topicFilter(filter), refs(0), status(SUBSCRIPTION_PENDING) {}
+};
+
+#ifndef AGGREGATE_MESSAGE_SIZE
+#define AGGREGATE_MESSAGE_SIZE 160
+#endif
+
+// Samples a value at a fast rate into a fixed size window and publishes one summary per interval:
+// {"n":count,"min":..,"max":..,"mean":..,"sd":..} optionally followed by "p50","p90","p99"
+// and "pts":[..] (the window downsampled to a few averaged points, oldest first).
+// All buffers are allocated when configured, sampling and publishing do not allocate.
+class AggregatePublishHandler : public PublishHandler {
+protected:
+	ArSampleFunction _sampleFunc;
+	long _sampleInterval = 0;
+	uint32_t _lastSample = 0;
+	float* _window = nullptr;
+	size_t _windowSize = 0;
+	char* _buffer = nullptr;
+	size_t _bufferSize = 0;
+	uint8_t _points = 0;
+	bool _percentiles = false;
+
+	uint32_t _count = 0;
+	float _min = 0;
+	float _max = 0;
+	double _mean = 0;
+	double _m2 = 0;
+
+	void reset() {
+		_count = 0;
+		_mean = 0;
+		_m2 = 0;
+	}
+	bool append(size_t& pos, const char* format, double value) {
+		if (pos >= _bufferSize)
+			return false;
+		int len = snprintf(_buffer + pos, _bufferSize - pos, format, value);
+		if (len < 0 || pos + len >= _bufferSize)
+			return false;
+		pos += len;
+		return true;
+	}
+public:
+	AggregatePublishHandler(size_t windowSize) {
+		if (windowSize == 0)
+			windowSize = 1;
+		_window = new float[windowSize];
+		_windowSize = windowSize;
+		_buffer = new char[AGGREGATE_MESSAGE_SIZE];
+		_bufferSize = AGGREGATE_MESSAGE_SIZE;
+	}
+	~AggregatePublishHandler() {
+		delete[] _window;
+		delete[] _buffer;
+	}
+	void setSampleFunction(ArSampleFunction func) { _sampleFunc = func; }
+	// 0 samples on every loop()
+	void setSampleInterval(long sampleInterval) { _sampleInterval = sampleInterval; }
+	AggregatePublishHandler& setPercentiles(bool value) {
+		_percentiles = value;
+		return *this;
+	}
+	AggregatePublishHandler& setPoints(uint8_t points) {
+		_points = points;
+		delete[] _buffer;
+		_bufferSize = AGGREGATE_MESSAGE_SIZE + (size_t)points * 16;
+		_buffer = new char[_bufferSize];
+		return *this;
+	}
+	void poll(uint32_t now) override {
+		if (!_sampleFunc)
+			return;
+		if (_lastSample > now)
+			_lastSample = 0;
+		if (_count > 0 && now - _lastSample < (uint32_t)_sampleInterval)
+			return;
+		_lastSample = now;
+		float value = _sampleFunc();
+		_window[_count % _windowSize] = value;
+		_count++;
+		if (_count == 1 || value < _min)
+			_min = value;
+		if (_count == 1 || value > _max)
+			_max = value;
+		// Welford, so count may exceed the window without losing the statistics
+		double delta = value - _mean;
+		_mean += delta / _count;
+		_m2 += delta * (value - _mean);
+	}
+	const char * handleFunction(void) override {
+		_lastMillis = millis();
+		if (_count == 0)
+			return nullptr;
+		size_t pos = 0;
+		append(pos, "{\"n\":%.0f", _count);
+		append(pos, ",\"min\":%g", _min);
+		append(pos, ",\"max\":%g", _max);
+		append(pos, ",\"mean\":%g", _mean);
+		append(pos, ",\"sd\":%g", _count > 1 ? sqrt(_m2 / (_count - 1)) : 0.0);
+
+		size_t n = _count < _windowSize ? _count : _windowSize;
+		size_t oldest = _count < _windowSize ? 0 : _count % _windowSize;
+		if (_points > 0) {
+			append(pos, ",\"pts\":[", 0);
+			size_t points = _points < n ? _points : n;
+			for (size_t p = 0; p < points; p++) {
+				size_t from = p * n / points;
+				size_t to = (p + 1) * n / points;
+				double sum = 0;
+				for (size_t i = from; i < to; i++)
+					sum += _window[(oldest + i) % _windowSize];
+				append(pos, p == 0 ? "%g" : ",%g", sum / (to - from));
+			}
+			append(pos, "]", 0);
+		}
+		if (_percentiles) {
+			// nearest rank, window order is no longer needed so sort it in place
+			std::sort(_window, _window + n);
+			append(pos, ",\"p50\":%g", _window[(n * 50 + 99) / 100 - 1]);
+			append(pos, ",\"p90\":%g", _window[(n * 90 + 99) / 100 - 1]);
+			append(pos, ",\"p99\":%g", _window[(n * 99 + 99) / 100 - 1]);
+		}
+		if (!append(pos, "}", 0)) {
+			// message buffer too small, better nothing than broken json
+			reset();
+			return nullptr;
+		}
+		reset();
+		return _buffer;
+	}
+};
+
 class ESPWiFiMqttWrapper {
 private:
 	const char* _mqttServer = "iot.a2n.tech";
@@ -262,16 +500,43 @@ private:
 	WiFiClientSecure _secureClient;
 
 	PubSubClient _mqttClient;
+	Mqtt5Client* _mqtt5Client = nullptr;	// only allocated by useMqtt5(true)
+	bool _useMqtt5 = false;
+	uint32_t _messageExpiry = 0;
+	TransmitQueue _txQueue;
+	LastValueCache _cache;
 	ListOf<SubscribeHandler*> _subscribehandlers;
 	ListOf<PublishHandler*> _publishHandlers;
-	Stream* _debugger;
+	ListOf<const char*> _cacheFilters;
+	ListOf<Subscription*> _subscriptions;
+	ArSubscriptionStatusFunction _onSubscriptionStatus;
+	uint16_t _subscribePacketId = 0x8000;
+
+	ArPowerProfile _powerProfile = POWER_PERFORMANCE;
+	bool _powerProfileSet = false;
+	uint16_t _keepAliveMin = 0;
+	uint16_t _keepAliveMax = 0;
+	// bounds of the current connection, an MQTT 5 broker may lower them
+	uint16_t _connectionKeepAliveMin = 0;
+	uint16_t _connectionKeepAliveMax = 0;
+	uint16_t _keepAliveCeiling = 0;
+	uint16_t _keepAlive = 0;
+	uint16_t _appliedKeepAlive = 0;
+	uint32_t _keepAliveSince = 0;
+	uint32_t _lastOutTraffic = 0;
+	uint32_t _pingTimeouts = 0;
+	bool _mqttWasConnected = false;
+	uint32_t _lastLoop = 0;
+	uint32_t _loopInterval = 0;
+	Stream* _debugger = nullptr;
+	LogRingBuffer _logBuffer;
 
 	int _reconnectMqttCount = 0;
 	int _reconnectWifiCount = 0;
 	int _lastReconnect = 0;
 	unsigned long now;
 	int _maxReconnect = 30;
-	bool _debug;
+	bool _debug = false;
 	bool _useSecureWiFi = false;
 
 
@@ -287,11 +552,21 @@ private:
 
 	SubscribeHandler& addSubscribeHandler(SubscribeHandler* handler) {
 		_subscribehandlers.add(handler);
+		acquireSubscription(handler->getTopicFilter());
 		return *handler;
 	};
 	bool removeSubscribeHandler(SubscribeHandler* handler) {
+		releaseSubscription(handler->getTopicFilter());
 		return _subscribehandlers.remove(handler);
 	};
+	Subscription* findSubscription(const char* topicFilter);
+	void acquireSubscription(const char* topicFilter);
+	void releaseSubscription(const char* topicFilter);
+	void setSubscriptionStatus(Subscription* subscription, ArSubscriptionStatus status);
+	void flushSubscriptions();
+	bool sendSubscriptions(bool subscribe);
+	void applyPowerProfile();
+	void updateKeepAlive(uint32_t now);
 	PublishHandler& addPublishHandler(PublishHandler* handler) {
 		_publishHandlers.add(handler);
 		return *handler;
@@ -299,52 +574,34 @@ private:
 	bool removePublishHandler(PublishHandler* handler) {
 		return _publishHandlers.remove(handler);
 	};
-	void print(const String& s) {
-		if (!_debug)
-			return;
-		_debugger->print(s);
-	};
-	void print(const char* c) {
-		if (!_debug)
-			return;
-		_debugger->print(c);
-	};
-	void print(char c) {
-		if (!_debug)
-			return;
-		_debugger->print(c);
-	};
-	void println(const String& s) {
-		if (!_debug)
-			return;
-		_debugger->println(s);
-	};
-	void println(char c) {
-		if (!_debug)
-			return;
-		_debugger->println(c);
-	};
-	void println(const char* c) {
-		if (!_debug)
-			return;
-		_debugger->println(c);
-	};
-	void println(const Printable& p) {
-		if (!_debug)
-			return;
-		_debugger->println(p);
-	};
-	void println(void) {
-		if (!_debug)
-			return;
-		_debugger->println();
-	};
+	// use the WRAPPER_LOGx macros instead of calling this directly
+#if defined(__GNUC__)
+	void log(const char* format, ...) __attribute__((format(printf, 2, 3)));
+#else
+	void log(const char* format, ...);
+#endif
 	void setMqttServer();
+	Client& activeClient() {
+		if (_useSecureWiFi)
+			return _secureClient;
+		return _defaultClient;
+	}
+	void flushTransmitQueue();
+	ArPublishResult enqueue(const char* topic, const uint8_t* payload, unsigned int plength, bool retained, bool progmem, bool useAlias = false);
+	static bool isAccepted(ArPublishResult result) {
+		return result == PUBLISH_SENT || result == PUBLISH_QUEUED;
+	}
+	bool mqttConnected();
+	int mqttState();
+	void mqttSetKeepAlive(uint16_t keepAlive);
+	Print& mqttWriter();
+	Mqtt5Client::CallbackFunction mqttCallback();
 #if defined(ESP8266)
 	void setClock();
 #endif
 public:
 	ESPWiFiMqttWrapper();
+	~ESPWiFiMqttWrapper();
 	void setMqttClientId(const char* ClientId);
 	void setMqttServer(const char* mqttServer);
 	void setMqttServer(const char* UserName, const char* Password);
@@ -355,15 +612,37 @@ public:
 		_debug = true;
 		_debugger = debugger;
 	}
+	// Log into an in RAM ring buffer of bufferSize bytes instead of writing to the stream
+	// directly. loop() writes only what the stream accepts without blocking, flushLog()
+	// drains it on demand. debugger may be nullptr to keep the log in RAM only.
+	bool setDebugger(Stream* debugger, size_t bufferSize) {
+		_debug = bufferSize > 0 || debugger != nullptr;
+		_debugger = debugger;
+		return _logBuffer.begin(bufferSize);
+	}
+	size_t flushLog(size_t maxBytes = SIZE_MAX);
+	size_t flushLog(Print& out, size_t maxBytes = SIZE_MAX);
 	SubscribeHandler& setSubscription(const char* topicFilter, ArSubscribeHandlerFunction func);
 	SubscribeHandler& setSubscription(const char* topicFilter, ArSubscribeMessageHandlerFunction func);
+	CommandHandler& setCommand(const char* topicFilter, const ArJsonField* fields, size_t fieldCount, ArCommandHandlerFunction func);
 	PublishHandler& setPublisher(const char* topic, int interval, ArPublishHandlerFunction func);
 	PublishHandler& setPublisher(const char* topic, int interval, int startDelay, ArPublishHandlerFunction func);
+	AggregatePublishHandler& setAggregatePublisher(const char* topic, int interval, int sampleInterval, size_t windowSize, ArSampleFunction func);
 	void removePublisher(const char* topic);
 	void removeSubscription(const char* topicFilter);
+	ArSubscriptionStatus getSubscriptionStatus(const char* topicFilter);
+	void onSubscriptionStatus(ArSubscriptionStatusFunction func) {
+		_onSubscriptionStatus = func;
+	}
 	void setMaxReconnect(int value) {
 		_maxReconnect = value;
 	};
+	// Ping every minSeconds after connecting and double the interval up to maxSeconds while the link
+	// stays healthy. A missed PINGRESP halves the upper bound. No pings while messages are going out.
+	void setAdaptiveKeepAlive(uint16_t minSeconds, uint16_t maxSeconds);
+	// WiFi sleep mode, listen interval and adaptive keepalive bounds in one go
+	void setPowerProfile(ArPowerProfile profile);
+	ArPowerStats getPowerStats();
 	void setWiFi(const char* hostName, const char* SSID, const char* wifiPassword);
 #if defined(ESP32)
 	void setCACert(const char* certificate);
@@ -381,6 +660,17 @@ public:
 	bool IsSecureWiFi() {
 		return _useSecureWiFi;
 	}
+	// Talk MQTT 5 instead of MQTT 3.1.1 (PubSubClient), set before the first loop().
+	// Publisher topics are replaced by topic aliases after their first message.
+	void useMqtt5(bool value);
+	bool IsMqtt5() {
+		return _useMqtt5;
+	}
+	// MQTT 5 only: Message Expiry Interval in seconds for every published message, 0 never expires
+	void setMessageExpiry(uint32_t seconds);
+	ArMqtt5Stats getMqtt5Stats();
+	// MQTT 5 only: QoS 1 publish, PUBLISH_WOULD_BLOCK while the broker's Receive Maximum is reached
+	ArPublishResult publishQos1(const char* topic, const uint8_t* payload, unsigned int plength, boolean retained = false);
 	void setWiFi(WiFiClient& client) {
 		_defaultClient = client;
 	}
@@ -388,6 +678,23 @@ public:
 		_secureClient = client;
 	}
 
+	// Keep the latest payload of every concrete topic matching the cached filters.
+	// slots: maximum number of topics, slotSize: bytes per topic (topic + payload + 2).
+	bool setLastValueCache(uint16_t slots, size_t slotSize, ArCacheEvictPolicy policy = CACHE_EVICT_LRU) {
+		return _cache.begin(slots, slotSize, policy);
+	}
+	// Cache every topic matching topicFilter. The filter stays subscribed while cached, even after
+	// removeSubscription(), and is subscribed again if already live so retained messages fill the cache.
+	void cacheSubscription(const char* topicFilter);
+	// Latest value of topic, or nullptr. Points into the cache, valid until the topic is updated again.
+	const ArCachedValue* getCachedValue(const char* topic) {
+		return _cache.get(topic);
+	}
+	// Called when a cached topic receives a payload different from the cached one
+	void onCachedValueChanged(ArCacheChangeFunction func) {
+		_cache.setChangeFunction(func);
+	}
+
 	void initWiFi();
 	void initMqtt();
 	bool loop();
@@ -396,23 +703,44 @@ public:
 	};
 	///* Overloaded functions end */
 	//void printData();
+	// Enable the non-blocking transmit queue. capacity is in bytes, 0 disables it.
+	// While enabled, publish() only queues the message and loop() writes it out
+	// as fast as the socket accepts it.
+	bool setTransmitQueue(size_t capacity) {
+		return _txQueue.begin(capacity);
+	}
+	void setTransmitHighWaterMark(size_t level, ArTransmitHighWaterFunction func) {
+		_txQueue.setHighWaterMark(level, func);
+	}
+	size_t getTransmitQueueUsed() {
+		return _txQueue.used();
+	}
+	uint32_t getTransmitDropped() {
+		return _txQueue.dropped();
+	}
+	ArPublishResult publishAsync(const char* topic, const char* payload, boolean retained = false) {
+		return enqueue(topic, (const uint8_t*)payload, strlen(payload), retained, false);
+	}
+	ArPublishResult publishAsync(const char* topic, const uint8_t* payload, unsigned int plength, boolean retained = false) {
+		return enqueue(topic, payload, plength, retained, false);
+	}
 	bool publish(const char* topic, const char* payload) {
-		return _mqttClient.publish(topic, payload);
+		return isAccepted(enqueue(topic, (const uint8_t*)payload, strlen(payload), false, false));
 	}
 	bool publish(const char* topic, const char* payload, boolean retained) {
-		return _mqttClient.publish(topic, payload, retained);
+		return isAccepted(enqueue(topic, (const uint8_t*)payload, strlen(payload), retained, false));
 	}
 	bool publish(const char* topic, const uint8_t* payload, unsigned int plength) {
-		return _mqttClient.publish(topic, payload, plength);
+		return isAccepted(enqueue(topic, payload, plength, false, false));
 	}
 	bool publish(const char* topic, const uint8_t* payload, unsigned int plength, boolean retained) {
-		return _mqttClient.publish(topic, payload, plength, retained);
+		return isAccepted(enqueue(topic, payload, plength, retained, false));
 	}
 	bool publish_P(const char* topic, const char* payload, boolean retained) {
-		return _mqttClient.publish_P(topic, payload, retained);
+		return isAccepted(enqueue(topic, (const uint8_t*)payload, strlen_P(payload), retained, true));
 	}
 	bool publish_P(const char* topic, const uint8_t* payload, unsigned int plength, boolean retained) {
-		return _mqttClient.publish_P(topic, payload, plength, retained);
+		return isAccepted(enqueue(topic, payload, plength, retained, true));
 	}
 };
 #endif
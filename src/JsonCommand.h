@@ -0,0 +1,501 @@
+ //------------------------------------------------------------------
+ // Copyright(c) 2022-2024 a2n Technology
+ // Anwar Minarso (anwar.minarso@gmail.com)
+ // https://github.com/anwarminarso/
+ // This file is part of the a2n ESPWiFiMqttWrapper v1.0.6
+ //
+ // This library is free software; you can redistribute it and/or
+ // modify it under the terms of the GNU Lesser General Public
+ // License as published by the Free Software Foundation; either
+ // version 2.1 of the License, or (at your option) any later version.
+ //
+ // This library is distributed in the hope that it will be useful,
+ // but WITHOUT ANY WARRANTY; without even the implied warranty of
+ // MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the GNU
+ // Lesser General Public License for more details
+ //------------------------------------------------------------------
+
+
+
+#ifndef JsonCommand_H
+#define JsonCommand_H
+
+#include <Arduino.h>
+#include <limits.h>
+
+// Maximum number of tokens (objects, arrays, keys and values) in one message
+#ifndef JSON_COMMAND_TOKENS
+#define JSON_COMMAND_TOKENS 32
+#endif
+
+// Maximum nesting of objects and arrays
+#ifndef JSON_COMMAND_DEPTH
+#define JSON_COMMAND_DEPTH 8
+#endif
+
+// Room for the decoded (unescaped, null terminated) strings read from one message
+#ifndef JSON_COMMAND_STRINGS
+#define JSON_COMMAND_STRINGS 128
+#endif
+
+enum ArJsonType {
+	JSON_UNDEFINED = 0,
+	JSON_OBJECT,
+	JSON_ARRAY,
+	JSON_STRING,
+	JSON_NUMBER,
+	JSON_BOOL,
+	JSON_NULL
+};
+
+enum ArJsonFieldType {
+	JSON_FIELD_INT = 0,		// integer number
+	JSON_FIELD_FLOAT,		// any number
+	JSON_FIELD_BOOL,		// true or false
+	JSON_FIELD_STRING		// string, decoded into the reader's string buffer
+};
+
+// One field of a command schema, path is the same as for JsonCommand lookups ("gpio", "led.color", "pins.0")
+struct ArJsonField {
+	const char* path;
+	ArJsonFieldType type;
+	bool required;
+};
+
+// Typed value of a bound field, same order as the schema
+struct ArJsonValue {
+	bool present;
+	long asInt;
+	float asFloat;
+	bool asBool;
+	const char* asString;
+};
+
+// Zero allocation JSON reader working in place on a message buffer, which is never modified.
+// parse() only records where every value starts and ends, lookups walk those tokens.
+// Strings are unescaped and null terminated into a small buffer of the reader when they are
+// read, they stay valid until the next parse() or the reader goes out of scope.
+class JsonCommand {
+private:
+	static const uint16_t NOT_DECODED = 0xFFFF;
+	struct Token {
+		uint8_t type;
+		uint16_t decoded;	// offset of the decoded string in _strings
+		uint16_t start;	// first char, for strings the one after the opening quote
+		uint16_t end;	// one past the last char, for strings the closing quote
+		uint16_t next;	// index of the next sibling, after this token's children
+	};
+	const char* _json = nullptr;
+	size_t _length = 0;
+	size_t _pos = 0;
+	uint16_t _count = 0;
+	Token _tokens[JSON_COMMAND_TOKENS];
+	char _strings[JSON_COMMAND_STRINGS];
+	size_t _stringsUsed = 0;
+
+	void skipWhitespace() {
+		while (_pos < _length && (_json[_pos] == ' ' || _json[_pos] == '\t' || _json[_pos] == '\r' || _json[_pos] == '\n'))
+			_pos++;
+	}
+	bool expect(const char* literal) {
+		size_t len = strlen(literal);
+		if (_length - _pos < len || memcmp(_json + _pos, literal, len) != 0)
+			return false;
+		_pos += len;
+		return true;
+	}
+	bool parseString(Token& token) {
+		token.type = JSON_STRING;
+		token.start = ++_pos;
+		while (_pos < _length) {
+			char c = _json[_pos];
+			if (c == '"') {
+				token.end = _pos++;
+				return true;
+			}
+			if ((uint8_t)c < 0x20)
+				return false;
+			if (c == '\\')
+				_pos++;
+			_pos++;
+		}
+		return false;
+	}
+	static bool isDigit(char c) {
+		return c >= '0' && c <= '9';
+	}
+	bool skipDigits() {
+		if (_pos >= _length || !isDigit(_json[_pos]))
+			return false;
+		while (_pos < _length && isDigit(_json[_pos]))
+			_pos++;
+		return true;
+	}
+	// -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)?
+	bool parseNumber(Token& token) {
+		token.type = JSON_NUMBER;
+		if (_json[_pos] == '-')
+			_pos++;
+		if (_pos < _length && _json[_pos] == '0')
+			_pos++;
+		else if (!skipDigits())
+			return false;
+		if (_pos < _length && _json[_pos] == '.') {
+			_pos++;
+			if (!skipDigits())
+				return false;
+		}
+		if (_pos < _length && (_json[_pos] == 'e' || _json[_pos] == 'E')) {
+			_pos++;
+			if (_pos < _length && (_json[_pos] == '+' || _json[_pos] == '-'))
+				_pos++;
+			if (!skipDigits())
+				return false;
+		}
+		token.end = _pos;
+		return true;
+	}
+	bool parseValue(uint8_t depth) {
+		if (depth > JSON_COMMAND_DEPTH || _count >= JSON_COMMAND_TOKENS)
+			return false;
+		skipWhitespace();
+		if (_pos >= _length)
+			return false;
+		uint16_t index = _count++;
+		Token& token = _tokens[index];
+		token.decoded = NOT_DECODED;
+		token.start = _pos;
+		char c = _json[_pos];
+		if (c == '{' || c == '[') {
+			bool isObject = c == '{';
+			char close = isObject ? '}' : ']';
+			token.type = isObject ? JSON_OBJECT : JSON_ARRAY;
+			_pos++;
+			skipWhitespace();
+			if (_pos < _length && _json[_pos] == close) {
+				_pos++;
+			}
+			else {
+				while (true) {
+					if (isObject) {
+						skipWhitespace();
+						if (_pos >= _length || _json[_pos] != '"' || !parseValue(depth + 1))
+							return false;
+						skipWhitespace();
+						if (_pos >= _length || _json[_pos++] != ':')
+							return false;
+					}
+					if (!parseValue(depth + 1))
+						return false;
+					skipWhitespace();
+					if (_pos >= _length)
+						return false;
+					c = _json[_pos++];
+					if (c == close)
+						break;
+					if (c != ',')
+						return false;
+				}
+			}
+			token.end = _pos;
+		}
+		else if (c == '"') {
+			if (!parseString(token))
+				return false;
+		}
+		else if (c == 't' || c == 'f') {
+			token.type = JSON_BOOL;
+			if (!expect(c == 't' ? "true" : "false"))
+				return false;
+			token.end = _pos;
+		}
+		else if (c == 'n') {
+			token.type = JSON_NULL;
+			if (!expect("null"))
+				return false;
+			token.end = _pos;
+		}
+		else if (c == '-' || isDigit(c)) {
+			if (!parseNumber(token))
+				return false;
+		}
+		else {
+			return false;
+		}
+		token.next = _count;
+		return true;
+	}
+	int find(const char* path) const {
+		if (_count == 0)
+			return -1;
+		int index = 0;
+		while (*path) {
+			size_t segmentLength = strcspn(path, ".");
+			const char* segment = path;
+			path += segmentLength;
+			if (*path == '.')
+				path++;
+			const Token& parent = _tokens[index];
+			int child = index + 1;
+			index = -1;
+			if (parent.type == JSON_OBJECT) {
+				while (child < parent.next) {
+					const Token& key = _tokens[child];
+					if ((size_t)(key.end - key.start) == segmentLength && memcmp(_json + key.start, segment, segmentLength) == 0) {
+						index = child + 1;
+						break;
+					}
+					child = _tokens[child + 1].next;
+				}
+			}
+			else if (parent.type == JSON_ARRAY) {
+				long n = 0;
+				for (size_t i = 0; i < segmentLength; i++) {
+					if (segment[i] < '0' || segment[i] > '9')
+						return -1;
+					n = n * 10 + (segment[i] - '0');
+				}
+				while (child < parent.next) {
+					if (n-- == 0) {
+						index = child;
+						break;
+					}
+					child = _tokens[child].next;
+				}
+			}
+			if (index < 0)
+				return -1;
+		}
+		return index;
+	}
+	bool isInteger(const Token& token) const {
+		for (uint16_t i = token.start; i < token.end; i++) {
+			char c = _json[i];
+			if (c == '.' || c == 'e' || c == 'E')
+				return false;
+		}
+		return true;
+	}
+	// false when the integer does not fit a long
+	bool toLong(const Token& token, long& value) const {
+		uint16_t i = token.start;
+		bool negative = _json[i] == '-';
+		if (negative)
+			i++;
+		unsigned long limit = negative ? (unsigned long)LONG_MAX + 1 : (unsigned long)LONG_MAX;
+		unsigned long result = 0;
+		for (; i < token.end; i++) {
+			unsigned long digit = _json[i] - '0';
+			if (result > (limit - digit) / 10)
+				return false;
+			result = result * 10 + digit;
+		}
+		value = negative ? (long)(0 - result) : (long)result;
+		return true;
+	}
+	double toDouble(const Token& token) const {
+		uint16_t i = token.start;
+		bool negative = _json[i] == '-';
+		if (negative)
+			i++;
+		double value = 0;
+		for (; i < token.end && _json[i] >= '0' && _json[i] <= '9'; i++)
+			value = value * 10 + (_json[i] - '0');
+		if (i < token.end && _json[i] == '.') {
+			double scale = 0.1;
+			for (i++; i < token.end && _json[i] >= '0' && _json[i] <= '9'; i++) {
+				value += (_json[i] - '0') * scale;
+				scale *= 0.1;
+			}
+		}
+		if (i < token.end && (_json[i] == 'e' || _json[i] == 'E')) {
+			i++;
+			bool negativeExponent = i < token.end && _json[i] == '-';
+			if (i < token.end && (_json[i] == '-' || _json[i] == '+'))
+				i++;
+			int exponent = 0;
+			for (; i < token.end && _json[i] >= '0' && _json[i] <= '9'; i++)
+				exponent = exponent * 10 + (_json[i] - '0');
+			value *= pow(10, negativeExponent ? -exponent : exponent);
+		}
+		return negative ? -value : value;
+	}
+	static uint8_t hexValue(char c) {
+		if (c >= '0' && c <= '9')
+			return c - '0';
+		if (c >= 'a' && c <= 'f')
+			return c - 'a' + 10;
+		if (c >= 'A' && c <= 'F')
+			return c - 'A' + 10;
+		return 0;
+	}
+	const char* decode(Token& token) {
+		if (token.decoded != NOT_DECODED)
+			return _strings + token.decoded;
+		// unescaping never makes a string longer
+		if ((size_t)(token.end - token.start) + 1 > JSON_COMMAND_STRINGS - _stringsUsed)
+			return nullptr;
+		char* begin = _strings + _stringsUsed;
+		char* out = begin;
+		for (uint16_t i = token.start; i < token.end; i++) {
+			char c = _json[i];
+			if (c != '\\' || i + 1 >= token.end) {
+				*out++ = c;
+				continue;
+			}
+			c = _json[++i];
+			switch (c) {
+			case 'b': *out++ = '\b'; break;
+			case 'f': *out++ = '\f'; break;
+			case 'n': *out++ = '\n'; break;
+			case 'r': *out++ = '\r'; break;
+			case 't': *out++ = '\t'; break;
+			case 'u': {
+				uint16_t code = 0;
+				for (uint8_t k = 0; k < 4 && i + 1 < token.end; k++)
+					code = (code << 4) | hexValue(_json[++i]);
+				// UTF-8, surrogate pairs are not combined
+				if (code < 0x80) {
+					*out++ = code;
+				}
+				else if (code < 0x800) {
+					*out++ = 0xC0 | (code >> 6);
+					*out++ = 0x80 | (code & 0x3F);
+				}
+				else {
+					*out++ = 0xE0 | (code >> 12);
+					*out++ = 0x80 | ((code >> 6) & 0x3F);
+					*out++ = 0x80 | (code & 0x3F);
+				}
+				break;
+			}
+			default: *out++ = c; break;
+			}
+		}
+		*out++ = '\0';
+		token.decoded = begin - _strings;
+		_stringsUsed = out - _strings;
+		return begin;
+	}
+public:
+	JsonCommand() {}
+	// json does not need to be null terminated, it must stay alive while values are read
+	bool parse(const char* json, size_t length) {
+		_json = json;
+		_length = length;
+		_pos = 0;
+		_count = 0;
+		_stringsUsed = 0;
+		// token positions are 16 bit
+		if (length >= 0xFFFF)
+			return false;
+		if (!parseValue(0)) {
+			_count = 0;
+			return false;
+		}
+		skipWhitespace();
+		if (_pos < _length && _json[_pos] != '\0') {
+			_count = 0;
+			return false;
+		}
+		return true;
+	}
+	bool parse(const uint8_t* payload, unsigned int length) {
+		return parse((const char*)payload, length);
+	}
+	// path: "key", "key.child" or "array.0", empty path is the root value
+	ArJsonType getType(const char* path) const {
+		int index = find(path);
+		if (index < 0)
+			return JSON_UNDEFINED;
+		return (ArJsonType)_tokens[index].type;
+	}
+	bool has(const char* path) const {
+		return find(path) >= 0;
+	}
+	bool isNull(const char* path) const {
+		return getType(path) == JSON_NULL;
+	}
+	// false when missing, not an integer or out of the range of long
+	bool getInt(const char* path, long& value) const {
+		int index = find(path);
+		if (index < 0 || _tokens[index].type != JSON_NUMBER || !isInteger(_tokens[index]))
+			return false;
+		return toLong(_tokens[index], value);
+	}
+	bool getFloat(const char* path, float& value) const {
+		int index = find(path);
+		if (index < 0 || _tokens[index].type != JSON_NUMBER)
+			return false;
+		value = toDouble(_tokens[index]);
+		return true;
+	}
+	bool getBool(const char* path, bool& value) const {
+		int index = find(path);
+		if (index < 0 || _tokens[index].type != JSON_BOOL)
+			return false;
+		value = _json[_tokens[index].start] == 't';
+		return true;
+	}
+	// decoded, null terminated copy of the string, nullptr when missing, not a string
+	// or JSON_COMMAND_STRINGS has no room left for it
+	const char* getString(const char* path) {
+		int index = find(path);
+		if (index < 0 || _tokens[index].type != JSON_STRING)
+			return nullptr;
+		return decode(_tokens[index]);
+	}
+	// Fills values (one per field) and returns nullptr, or returns the path of the first
+	// missing required field or field of the wrong type (or a string that does not fit JSON_COMMAND_STRINGS)
+	const char* bind(const ArJsonField* fields, size_t fieldCount, ArJsonValue* values) {
+		for (size_t i = 0; i < fieldCount; i++) {
+			ArJsonValue& value = values[i];
+			value.present = false;
+			value.asInt = 0;
+			value.asFloat = 0;
+			value.asBool = false;
+			value.asString = nullptr;
+			int index = find(fields[i].path);
+			if (index < 0 || _tokens[index].type == JSON_NULL) {
+				if (fields[i].required)
+					return fields[i].path;
+				continue;
+			}
+			Token& token = _tokens[index];
+			switch (fields[i].type) {
+			case JSON_FIELD_INT:
+				if (token.type != JSON_NUMBER || !isInteger(token) || !toLong(token, value.asInt))
+					return fields[i].path;
+				value.asFloat = value.asInt;
+				break;
+			case JSON_FIELD_FLOAT:
+				if (token.type != JSON_NUMBER)
+					return fields[i].path;
+				value.asFloat = toDouble(token);
+				// saturate, converting an out of range float is undefined
+				if (value.asFloat >= (float)LONG_MAX)
+					value.asInt = LONG_MAX;
+				else if (value.asFloat <= (float)LONG_MIN)
+					value.asInt = LONG_MIN;
+				else
+					value.asInt = (long)value.asFloat;
+				break;
+			case JSON_FIELD_BOOL:
+				if (token.type != JSON_BOOL)
+					return fields[i].path;
+				value.asBool = _json[token.start] == 't';
+				break;
+			case JSON_FIELD_STRING:
+				if (token.type != JSON_STRING)
+					return fields[i].path;
+				value.asString = decode(token);
+				if (!value.asString)
+					return fields[i].path;
+				break;
+			}
+			value.present = true;
+		}
+		return nullptr;
+	}
+};
+#endif
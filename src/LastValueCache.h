@@ -0,0 +1,243 @@
+ //------------------------------------------------------------------
+ // Copyright(c) 2022-2024 a2n Technology
+ // Anwar Minarso (anwar.minarso@gmail.com)
+ // https://github.com/anwarminarso/
+ // This file is part of the a2n ESPWiFiMqttWrapper v1.0.6
+ //
+ // This library is free software; you can redistribute it and/or
+ // modify it under the terms of the GNU Lesser General Public
+ // License as published by the Free Software Foundation; either
+ // version 2.1 of the License, or (at your option) any later version.
+ //
+ // This library is distributed in the hope that it will be useful,
+ // but WITHOUT ANY WARRANTY; without even the implied warranty of
+ // MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the GNU
+ // Lesser General Public License for more details
+ //------------------------------------------------------------------
+
+
+
+#ifndef LastValueCache_H
+#define LastValueCache_H
+
+#include <Arduino.h>
+
+enum ArCacheEvictPolicy {
+	CACHE_EVICT_LRU = 0,	// evict the topic that was read or updated least recently
+	CACHE_EVICT_OLDEST,		// evict the topic that received a message least recently, changed or not
+	CACHE_EVICT_NONE		// keep the existing topics, ignore new ones when full
+};
+
+struct ArCachedValue {
+	const char* topic;
+	const uint8_t* payload;	// always null terminated, can be used as const char*
+	unsigned int length;
+	uint32_t version;		// incremented every time the payload changes
+	uint32_t sequence;		// cache wide sequence number of the last change
+	uint32_t updated;		// millis() of the last received message
+};
+
+typedef std::function<void(const ArCachedValue&)> ArCacheChangeFunction;
+
+// Latest payload per concrete topic, stored in a preallocated arena of fixed size slots.
+// Lookup is a hash of the topic, values are returned in place without copying and stay
+// valid until the same topic is updated or evicted.
+class LastValueCache {
+private:
+	static const uint16_t NONE = 0xFFFF;
+	struct Slot {
+		ArCachedValue value;
+		uint32_t hash;
+		uint32_t lastAccess;	// _clock of the last read or update
+		uint32_t lastUpdate;	// _clock of the last received message
+		uint16_t next;
+		bool used;
+	};
+	Slot* _slots = nullptr;
+	uint16_t* _buckets = nullptr;
+	uint8_t* _arena = nullptr;
+	uint16_t _slotCount = 0;
+	uint16_t _bucketMask = 0;
+	size_t _slotSize = 0;
+	uint32_t _sequence = 0;
+	uint32_t _clock = 0;
+	uint32_t _rejected = 0;
+	ArCacheEvictPolicy _policy = CACHE_EVICT_LRU;
+	ArCacheChangeFunction _onChange;
+
+	static uint32_t hashOf(const char* topic) {
+		// FNV-1a
+		uint32_t hash = 2166136261UL;
+		while (*topic) {
+			hash ^= (uint8_t)*topic++;
+			hash *= 16777619UL;
+		}
+		return hash;
+	}
+	uint16_t find(const char* topic, uint32_t hash) const {
+		uint16_t i = _buckets[hash & _bucketMask];
+		while (i != NONE) {
+			if (_slots[i].hash == hash && strcmp(_slots[i].value.topic, topic) == 0)
+				return i;
+			i = _slots[i].next;
+		}
+		return NONE;
+	}
+	void unlink(uint16_t index) {
+		uint16_t* link = &_buckets[_slots[index].hash & _bucketMask];
+		while (*link != index)
+			link = &_slots[*link].next;
+		*link = _slots[index].next;
+		_slots[index].used = false;
+	}
+	uint32_t age(const Slot& slot) const {
+		return _policy == CACHE_EVICT_LRU ? slot.lastAccess : slot.lastUpdate;
+	}
+	uint16_t allocate() {
+		uint16_t victim = NONE;
+		for (uint16_t i = 0; i < _slotCount; i++) {
+			if (!_slots[i].used)
+				return i;
+			if (_policy == CACHE_EVICT_NONE)
+				continue;
+			if (victim == NONE || age(_slots[i]) < age(_slots[victim]))
+				victim = i;
+		}
+		if (victim != NONE)
+			unlink(victim);
+		return victim;
+	}
+	void release() {
+		delete[] _slots;
+		delete[] _buckets;
+		::free(_arena);
+		_slots = nullptr;
+		_buckets = nullptr;
+		_arena = nullptr;
+		_slotCount = 0;
+	}
+public:
+	LastValueCache() {}
+	~LastValueCache() {
+		release();
+	}
+	// slots: number of topics kept, slotSize: bytes per topic for topic name + payload + 2
+	bool begin(uint16_t slots, size_t slotSize, ArCacheEvictPolicy policy) {
+		release();
+		if (slots == 0 || slotSize < 2)
+			return true;
+		if (slots > 0x8000)
+			return false;
+		uint16_t buckets = 1;
+		while (buckets < slots)
+			buckets <<= 1;
+		_slots = new Slot[slots];
+		_buckets = new uint16_t[buckets];
+		_arena = (uint8_t*)malloc(slots * slotSize);
+		if (!_slots || !_buckets || !_arena) {
+			release();
+			return false;
+		}
+		for (uint16_t i = 0; i < slots; i++)
+			_slots[i].used = false;
+		for (uint16_t i = 0; i < buckets; i++)
+			_buckets[i] = NONE;
+		_slotCount = slots;
+		_bucketMask = buckets - 1;
+		_slotSize = slotSize;
+		_policy = policy;
+		return true;
+	}
+	bool isEnabled() const {
+		return _slots != nullptr;
+	}
+	void setChangeFunction(ArCacheChangeFunction func) {
+		_onChange = func;
+	}
+	// messages that did not fit in a slot (the topic is dropped from the cache), or found no free slot with CACHE_EVICT_NONE
+	uint32_t rejected() const {
+		return _rejected;
+	}
+	size_t length() const {
+		size_t count = 0;
+		for (uint16_t i = 0; i < _slotCount; i++) {
+			if (_slots[i].used)
+				count++;
+		}
+		return count;
+	}
+	const ArCachedValue* get(const char* topic) {
+		if (!_slots)
+			return nullptr;
+		uint16_t i = find(topic, hashOf(topic));
+		if (i == NONE)
+			return nullptr;
+		_slots[i].lastAccess = ++_clock;
+		return &_slots[i].value;
+	}
+	void update(const char* topic, const uint8_t* payload, unsigned int length) {
+		if (!_slots)
+			return;
+		size_t topicLength = strlen(topic);
+		uint32_t hash = hashOf(topic);
+		uint16_t i = find(topic, hash);
+		if (topicLength + length + 2 > _slotSize) {
+			// never keep serving the value this message replaced
+			if (i != NONE)
+				unlink(i);
+			_rejected++;
+			return;
+		}
+		Slot* slot;
+		if (i != NONE) {
+			slot = &_slots[i];
+			slot->value.updated = millis();
+			slot->lastAccess = slot->lastUpdate = ++_clock;
+			if (slot->value.length == length && memcmp(slot->value.payload, payload, length) == 0)
+				return;
+		}
+		else {
+			i = allocate();
+			if (i == NONE) {
+				_rejected++;
+				return;
+			}
+			slot = &_slots[i];
+			uint8_t* data = _arena + (size_t)i * _slotSize;
+			memcpy(data, topic, topicLength + 1);
+			slot->value.topic = (const char*)data;
+			slot->value.payload = data + topicLength + 1;
+			slot->value.version = 0;
+			slot->value.updated = millis();
+			slot->hash = hash;
+			slot->lastAccess = slot->lastUpdate = ++_clock;
+			slot->used = true;
+			slot->next = _buckets[hash & _bucketMask];
+			_buckets[hash & _bucketMask] = i;
+		}
+		uint8_t* dest = (uint8_t*)slot->value.payload;
+		memcpy(dest, payload, length);
+		dest[length] = 0;
+		slot->value.length = length;
+		slot->value.version++;
+		slot->value.sequence = ++_sequence;
+		if (_onChange)
+			_onChange(slot->value);
+	}
+	bool remove(const char* topic) {
+		if (!_slots)
+			return false;
+		uint16_t i = find(topic, hashOf(topic));
+		if (i == NONE)
+			return false;
+		unlink(i);
+		return true;
+	}
+	void clear() {
+		for (uint16_t i = 0; i < _slotCount; i++)
+			_slots[i].used = false;
+		for (uint16_t i = 0; i <= _bucketMask && _buckets; i++)
+			_buckets[i] = NONE;
+	}
+};
+#endif
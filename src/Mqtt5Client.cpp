@@ -0,0 +1,538 @@
+//------------------------------------------------------------------
+// Copyright(c) 2022-2024 a2n Technology
+// Anwar Minarso (anwar.minarso@gmail.com)
+// https://github.com/anwarminarso/
+// This file is part of the a2n ESPWiFiMqttWrapper v1.0.6
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the GNU
+// Lesser General Public License for more details
+//------------------------------------------------------------------
+
+
+#include "Mqtt5Client.h"
+
+#define MQTT5_CONNECT		0x10
+#define MQTT5_CONNACK		0x20
+#define MQTT5_PUBLISH		0x30
+#define MQTT5_PUBACK		0x40
+#define MQTT5_SUBACK		0x90
+#define MQTT5_UNSUBACK		0xB0
+#define MQTT5_PINGREQ		0xC0
+#define MQTT5_PINGRESP		0xD0
+#define MQTT5_DISCONNECT	0xE0
+
+#define MQTT5_PROP_MESSAGE_EXPIRY		0x02
+#define MQTT5_PROP_SERVER_KEEP_ALIVE	0x13
+#define MQTT5_PROP_RECEIVE_MAXIMUM		0x21
+#define MQTT5_PROP_TOPIC_ALIAS_MAXIMUM	0x22
+#define MQTT5_PROP_TOPIC_ALIAS			0x23
+#define MQTT5_PROP_MAXIMUM_PACKET_SIZE	0x27
+
+// property id and 2 byte alias
+#define MQTT5_ALIAS_PROPERTY_LENGTH		3
+
+Mqtt5Client::Mqtt5Client() {
+	clearAliases();
+}
+
+size_t Mqtt5Client::encodeLength(uint8_t* out, uint32_t length) {
+	size_t count = 0;
+	do {
+		uint8_t encoded = length & 0x7F;
+		length >>= 7;
+		if (length > 0)
+			encoded |= 0x80;
+		out[count++] = encoded;
+	} while (length > 0 && count < 4);
+	return count;
+}
+bool Mqtt5Client::readLength(const uint8_t*& pos, const uint8_t* end, uint32_t& length) {
+	length = 0;
+	uint32_t multiplier = 1;
+	for (uint8_t i = 0; i < 4; i++) {
+		if (pos >= end)
+			return false;
+		uint8_t encoded = *pos++;
+		length += (encoded & 0x7F) * multiplier;
+		if (!(encoded & 0x80))
+			return true;
+		multiplier <<= 7;
+	}
+	return false;
+}
+// Reads one property, value is only set for the integer ones
+bool Mqtt5Client::readProperty(const uint8_t*& pos, const uint8_t* end, uint8_t& id, uint32_t& value) {
+	if (pos >= end)
+		return false;
+	id = *pos++;
+	value = 0;
+	size_t size;
+	switch (id) {
+	case 0x01: case 0x17: case 0x19: case 0x24: case 0x25: case 0x28: case 0x29: case 0x2A:
+		size = 1;
+		break;
+	case 0x13: case 0x21: case 0x22: case 0x23:
+		size = 2;
+		break;
+	case 0x02: case 0x11: case 0x18: case 0x27:
+		size = 4;
+		break;
+	case 0x0B:
+		return readLength(pos, end, value);
+	case 0x26:
+		// user property, two strings
+		for (uint8_t i = 0; i < 2; i++) {
+			if (end - pos < 2)
+				return false;
+			size = (pos[0] << 8) | pos[1];
+			if ((size_t)(end - pos) < 2 + size)
+				return false;
+			pos += 2 + size;
+		}
+		return true;
+	default:
+		// strings and binary data
+		if (end - pos < 2)
+			return false;
+		size = (pos[0] << 8) | pos[1];
+		if ((size_t)(end - pos) < 2 + size)
+			return false;
+		pos += 2 + size;
+		return true;
+	}
+	if ((size_t)(end - pos) < size)
+		return false;
+	for (size_t i = 0; i < size; i++)
+		value = (value << 8) | *pos++;
+	return true;
+}
+void Mqtt5Client::clearAliases() {
+	for (uint8_t i = 0; i < MQTT5_MAX_TOPIC_ALIASES; i++) {
+		_aliases[i] = nullptr;
+		_inboundAliases[i] = "";
+	}
+}
+uint16_t Mqtt5Client::nextPacketId() {
+	if (++_nextPacketId == 0)
+		_nextPacketId = 1;
+	return _nextPacketId;
+}
+size_t Mqtt5Client::write(uint8_t b) {
+	_lastOutActivity = millis();
+	return _client->write(b);
+}
+size_t Mqtt5Client::write(const uint8_t* buffer, size_t size) {
+	_lastOutActivity = millis();
+	return _client->write(buffer, size);
+}
+bool Mqtt5Client::writeAll(const uint8_t* data, size_t length, bool progmem) {
+	if (!progmem)
+		return write(data, length) == length;
+	uint8_t chunk[64];
+	while (length > 0) {
+		size_t size = length < sizeof(chunk) ? length : sizeof(chunk);
+		memcpy_P(chunk, data, size);
+		if (write(chunk, size) != size)
+			return false;
+		data += size;
+		length -= size;
+	}
+	return true;
+}
+void Mqtt5Client::resetRead() {
+	_received = 0;
+	_packetLength = 0;
+	_headerLength = 0;
+	_multiplier = 1;
+	_remaining = 0;
+}
+// Collects whatever the socket has, true once a whole packet is in the buffer
+bool Mqtt5Client::readPacket() {
+	while (_client->available()) {
+		int b = _client->read();
+		if (b < 0)
+			break;
+		if (_received < sizeof(_buffer))
+			_buffer[_received] = b;
+		_received++;
+		if (_received > 1 && _headerLength == 0) {
+			_remaining += (b & 0x7F) * _multiplier;
+			_multiplier <<= 7;
+			if (!(b & 0x80)) {
+				_headerLength = _received;
+				_packetLength = _headerLength + _remaining;
+			}
+			else if (_received >= 5) {
+				// malformed remaining length
+				_client->stop();
+				_state = MQTT_CONNECTION_LOST;
+				resetRead();
+				return false;
+			}
+		}
+		if (_headerLength && _received == _packetLength)
+			return true;
+	}
+	return false;
+}
+bool Mqtt5Client::connect(const char* id, const char* user, const char* pass) {
+	if (connected())
+		return true;
+	if (!_client || !_client->connect(_host, _port)) {
+		_state = MQTT_CONNECT_FAILED;
+		return false;
+	}
+	resetRead();
+	clearAliases();
+	_inflight = 0;
+	_pingOutstanding = false;
+	_serverAliasMaximum = 0;
+	_serverReceiveMaximum = 0xFFFF;
+	_serverMaximumPacketSize = 0;
+	_serverKeepAlive = -1;
+
+	// variable header
+	uint8_t header[32];
+	size_t length = 0;
+	static const uint8_t protocol[] = { 0x00, 0x04, 'M', 'Q', 'T', 'T', 0x05 };
+	memcpy(header, protocol, sizeof(protocol));
+	length = sizeof(protocol);
+	uint8_t flags = 0x02; // clean start
+	if (user)
+		flags |= 0x80;
+	if (user && pass)
+		flags |= 0x40;
+	header[length++] = flags;
+	header[length++] = _keepAlive >> 8;
+	header[length++] = _keepAlive & 0xFF;
+	header[length++] = 11; // properties length
+	header[length++] = MQTT5_PROP_RECEIVE_MAXIMUM;
+	header[length++] = MQTT5_RECEIVE_MAXIMUM >> 8;
+	header[length++] = MQTT5_RECEIVE_MAXIMUM & 0xFF;
+	header[length++] = MQTT5_PROP_TOPIC_ALIAS_MAXIMUM;
+	header[length++] = MQTT5_MAX_TOPIC_ALIASES >> 8;
+	header[length++] = MQTT5_MAX_TOPIC_ALIASES & 0xFF;
+	header[length++] = MQTT5_PROP_MAXIMUM_PACKET_SIZE;
+	header[length++] = 0;
+	header[length++] = 0;
+	header[length++] = sizeof(_buffer) >> 8;
+	header[length++] = sizeof(_buffer) & 0xFF;
+
+	const char* strings[3] = { id ? id : "", user, (user && pass) ? pass : nullptr };
+	uint32_t remaining = length;
+	for (uint8_t i = 0; i < 3; i++) {
+		if (strings[i])
+			remaining += 2 + strlen(strings[i]);
+	}
+	uint8_t fixed[5];
+	fixed[0] = MQTT5_CONNECT;
+	size_t fixedLength = 1 + encodeLength(fixed + 1, remaining);
+	bool ok = writeAll(fixed, fixedLength) && writeAll(header, length);
+	for (uint8_t i = 0; ok && i < 3; i++) {
+		if (!strings[i])
+			continue;
+		size_t len = strlen(strings[i]);
+		uint8_t lengthBytes[2] = { (uint8_t)(len >> 8), (uint8_t)(len & 0xFF) };
+		ok = writeAll(lengthBytes, 2) && writeAll((const uint8_t*)strings[i], len);
+	}
+	if (!ok) {
+		_client->stop();
+		_state = MQTT_CONNECT_FAILED;
+		return false;
+	}
+
+	uint32_t start = millis();
+	while (!readPacket()) {
+		if (!_client->connected() || millis() - start >= MQTT_SOCKET_TIMEOUT * 1000UL) {
+			_client->stop();
+			_state = MQTT_CONNECTION_TIMEOUT;
+			return false;
+		}
+		delay(1);
+	}
+	if ((_buffer[0] & 0xF0) != MQTT5_CONNACK || _received > sizeof(_buffer) || _packetLength < _headerLength + 2) {
+		_client->stop();
+		_state = MQTT_CONNECT_FAILED;
+		resetRead();
+		return false;
+	}
+	uint8_t reasonCode = _buffer[_headerLength + 1];
+	if (reasonCode != 0) {
+		_client->stop();
+		_state = reasonCode;
+		resetRead();
+		return false;
+	}
+	const uint8_t* pos = _buffer + _headerLength + 2;
+	const uint8_t* end = _buffer + _packetLength;
+	uint32_t propertiesLength;
+	if (readLength(pos, end, propertiesLength) && propertiesLength <= (uint32_t)(end - pos)) {
+		end = pos + propertiesLength;
+		uint8_t propertyId;
+		uint32_t value;
+		while (pos < end && readProperty(pos, end, propertyId, value)) {
+			switch (propertyId) {
+			case MQTT5_PROP_TOPIC_ALIAS_MAXIMUM:
+				_serverAliasMaximum = value;
+				break;
+			case MQTT5_PROP_RECEIVE_MAXIMUM:
+				_serverReceiveMaximum = value;
+				break;
+			case MQTT5_PROP_MAXIMUM_PACKET_SIZE:
+				_serverMaximumPacketSize = value;
+				break;
+			case MQTT5_PROP_SERVER_KEEP_ALIVE:
+				// the broker's value replaces ours for this connection
+				_serverKeepAlive = value;
+				_keepAlive = value;
+				break;
+			}
+		}
+	}
+	resetRead();
+	_lastInActivity = _lastOutActivity = millis();
+	_state = MQTT_CONNECTED;
+	return true;
+}
+void Mqtt5Client::disconnect() {
+	if (connected()) {
+		uint8_t packet[3] = { MQTT5_DISCONNECT, 0x01, 0x00 };
+		writeAll(packet, sizeof(packet));
+	}
+	if (_client)
+		_client->stop();
+	_state = MQTT_DISCONNECTED;
+}
+bool Mqtt5Client::connected() {
+	if (!_client || _state != MQTT_CONNECTED)
+		return false;
+	if (!_client->connected()) {
+		_state = MQTT_CONNECTION_LOST;
+		_client->stop();
+		return false;
+	}
+	return true;
+}
+bool Mqtt5Client::loop() {
+	if (!connected())
+		return false;
+	uint32_t t = millis();
+	if (_keepAlive && (t - _lastInActivity > _keepAlive * 1000UL || t - _lastOutActivity > _keepAlive * 1000UL)) {
+		if (_pingOutstanding) {
+			_state = MQTT_CONNECTION_TIMEOUT;
+			_client->stop();
+			return false;
+		}
+		uint8_t ping[2] = { MQTT5_PINGREQ, 0x00 };
+		writeAll(ping, sizeof(ping));
+		_lastInActivity = t;
+		_pingOutstanding = true;
+	}
+	while (_state == MQTT_CONNECTED && readPacket()) {
+		_lastInActivity = millis();
+		if (_received <= sizeof(_buffer))
+			handlePacket();
+		resetRead();
+	}
+	return _state == MQTT_CONNECTED;
+}
+void Mqtt5Client::handlePacket() {
+	switch (_buffer[0] & 0xF0) {
+	case MQTT5_PUBLISH:
+		handlePublish();
+		break;
+	case MQTT5_PUBACK:
+		if (_inflight > 0)
+			_inflight--;
+		break;
+	case MQTT5_PINGRESP:
+		_pingOutstanding = false;
+		break;
+	case MQTT5_DISCONNECT:
+		_client->stop();
+		_state = MQTT_DISCONNECTED;
+		break;
+	default:
+		// SUBACK / UNSUBACK carry nothing we act on
+		break;
+	}
+}
+void Mqtt5Client::handlePublish() {
+	uint8_t qos = (_buffer[0] >> 1) & 0x03;
+	uint8_t* pos = _buffer + _headerLength;
+	const uint8_t* end = _buffer + _packetLength;
+	if (end - pos < 2)
+		return;
+	uint16_t topicLength = (pos[0] << 8) | pos[1];
+	if ((size_t)(end - pos) < 2u + topicLength)
+		return;
+	uint8_t* topicStart = pos + 2;
+	pos += 2 + topicLength;
+	uint16_t packetId = 0;
+	if (qos > 0) {
+		if (end - pos < 2)
+			return;
+		packetId = (pos[0] << 8) | pos[1];
+		pos += 2;
+	}
+	const uint8_t* properties = pos;
+	uint32_t propertiesLength;
+	if (!readLength(properties, end, propertiesLength) || propertiesLength > (uint32_t)(end - properties))
+		return;
+	uint8_t* payload = (uint8_t*)properties + propertiesLength;
+	const uint8_t* propertiesEnd = payload;
+	uint16_t alias = 0;
+	uint8_t propertyId;
+	uint32_t value;
+	while (properties < propertiesEnd && readProperty(properties, propertiesEnd, propertyId, value)) {
+		if (propertyId == MQTT5_PROP_TOPIC_ALIAS)
+			alias = value;
+	}
+	if (alias > MQTT5_MAX_TOPIC_ALIASES) {
+		// broker broke the limit we announced, reason code 0x94 Topic Alias invalid
+		uint8_t packet[3] = { MQTT5_DISCONNECT, 0x01, 0x94 };
+		writeAll(packet, sizeof(packet));
+		_client->stop();
+		_state = MQTT_DISCONNECTED;
+		return;
+	}
+
+	char* topic;
+	if (topicLength > 0) {
+		// move the topic one byte back over its length to make room for the terminator
+		memmove(topicStart - 1, topicStart, topicLength);
+		topic = (char*)topicStart - 1;
+		topic[topicLength] = '\0';
+		if (alias)
+			_inboundAliases[alias - 1] = topic;
+	}
+	else {
+		if (!alias || _inboundAliases[alias - 1].length() == 0) {
+			// alias was never defined (or storing it ran out of memory), reason code 0x82 Protocol Error
+			uint8_t packet[3] = { MQTT5_DISCONNECT, 0x01, 0x82 };
+			writeAll(packet, sizeof(packet));
+			_client->stop();
+			_state = MQTT_DISCONNECTED;
+			return;
+		}
+		topic = (char*)_inboundAliases[alias - 1].c_str();
+	}
+
+	if (_callback)
+		_callback(topic, payload, end - payload);
+	if (qos == 1) {
+		uint8_t ack[4] = { MQTT5_PUBACK, 0x02, (uint8_t)(packetId >> 8), (uint8_t)(packetId & 0xFF) };
+		writeAll(ack, sizeof(ack));
+	}
+}
+uint16_t Mqtt5Client::prepareAlias(const char* topic, bool& isNew) {
+	uint16_t maximum = _serverAliasMaximum < MQTT5_MAX_TOPIC_ALIASES ? _serverAliasMaximum : MQTT5_MAX_TOPIC_ALIASES;
+	uint16_t freeAlias = 0;
+	isNew = false;
+	// the 3 byte alias property is not shorter than the topic name
+	if (strlen(topic) <= MQTT5_ALIAS_PROPERTY_LENGTH)
+		return 0;
+	for (uint16_t i = 0; i < maximum; i++) {
+		if (_aliases[i] == topic || (_aliases[i] && strcmp(_aliases[i], topic) == 0))
+			return i + 1;
+		if (!_aliases[i] && !freeAlias)
+			freeAlias = i + 1;
+	}
+	// table full, send the topic in full rather than replacing aliases back and forth
+	isNew = freeAlias != 0;
+	return freeAlias;
+}
+void Mqtt5Client::commitAlias(const char* topic, uint16_t alias, bool isNew) {
+	if (!alias)
+		return;
+	if (isNew) {
+		_aliases[alias - 1] = topic;
+		// the defining message carries the topic name and the alias property
+		_aliasBytesSaved -= MQTT5_ALIAS_PROPERTY_LENGTH;
+	}
+	else {
+		_aliasedMessages++;
+		// topic name replaced by the alias property
+		_aliasBytesSaved += (int32_t)strlen(topic) - MQTT5_ALIAS_PROPERTY_LENGTH;
+	}
+}
+void Mqtt5Client::releaseAlias(const char* topic) {
+	for (uint8_t i = 0; i < MQTT5_MAX_TOPIC_ALIASES; i++) {
+		if (_aliases[i] == topic)
+			_aliases[i] = nullptr;
+	}
+}
+size_t Mqtt5Client::buildPublishProperties(uint16_t alias, uint8_t* properties) {
+	size_t length = 0;
+	if (_messageExpiry) {
+		properties[length++] = MQTT5_PROP_MESSAGE_EXPIRY;
+		properties[length++] = _messageExpiry >> 24;
+		properties[length++] = (_messageExpiry >> 16) & 0xFF;
+		properties[length++] = (_messageExpiry >> 8) & 0xFF;
+		properties[length++] = _messageExpiry & 0xFF;
+	}
+	if (alias) {
+		properties[length++] = MQTT5_PROP_TOPIC_ALIAS;
+		properties[length++] = alias >> 8;
+		properties[length++] = alias & 0xFF;
+	}
+	return length;
+}
+bool Mqtt5Client::publish(const char* topic, const uint8_t* payload, unsigned int plength, bool retained, uint8_t qos, bool useAlias, bool progmem) {
+	if (!connected())
+		return false;
+	if (qos > 1)
+		qos = 1;
+	if (qos && !canPublishQos1())
+		return false;
+	bool isNew = false;
+	uint16_t alias = useAlias ? prepareAlias(topic, isNew) : 0;
+	size_t topicLength = (alias && !isNew) ? 0 : strlen(topic);
+	if (topicLength > 0xFFFF)
+		return false;
+
+	uint8_t header[24];
+	size_t length = 0;
+	uint8_t properties[8];
+	size_t propertiesLength = buildPublishProperties(alias, properties);
+	uint32_t remaining = 2 + topicLength + (qos ? 2 : 0) + 1 + propertiesLength + plength;
+	header[length++] = MQTT5_PUBLISH | (qos << 1) | (retained ? 1 : 0);
+	length += encodeLength(header + length, remaining);
+	if (_serverMaximumPacketSize && length + remaining > _serverMaximumPacketSize)
+		return false;
+	header[length++] = topicLength >> 8;
+	header[length++] = topicLength & 0xFF;
+	bool ok = writeAll(header, length) && writeAll((const uint8_t*)topic, topicLength);
+	length = 0;
+	if (qos) {
+		uint16_t packetId = nextPacketId();
+		header[length++] = packetId >> 8;
+		header[length++] = packetId & 0xFF;
+	}
+	header[length++] = propertiesLength;
+	memcpy(header + length, properties, propertiesLength);
+	length += propertiesLength;
+	ok = ok && writeAll(header, length) && writeAll(payload, plength, progmem);
+	if (!ok)
+		return false;
+	commitAlias(topic, alias, isNew);
+	if (qos)
+		_inflight++;
+	return true;
+}
+ArMqtt5Stats Mqtt5Client::getStats() {
+	ArMqtt5Stats stats;
+	stats.topicAliasMaximum = _serverAliasMaximum;
+	stats.receiveMaximum = _serverReceiveMaximum;
+	stats.inflight = _inflight;
+	stats.aliasedMessages = _aliasedMessages;
+	stats.aliasBytesSaved = _aliasBytesSaved > 0 ? _aliasBytesSaved : 0;
+	return stats;
+}
@@ -0,0 +1,156 @@
+ //------------------------------------------------------------------
+ // Copyright(c) 2022-2024 a2n Technology
+ // Anwar Minarso (anwar.minarso@gmail.com)
+ // https://github.com/anwarminarso/
+ // This file is part of the a2n ESPWiFiMqttWrapper v1.0.6
+ //
+ // This library is free software; you can redistribute it and/or
+ // modify it under the terms of the GNU Lesser General Public
+ // License as published by the Free Software Foundation; either
+ // version 2.1 of the License, or (at your option) any later version.
+ //
+ // This library is distributed in the hope that it will be useful,
+ // but WITHOUT ANY WARRANTY; without even the implied warranty of
+ // MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the GNU
+ // Lesser General Public License for more details
+ //------------------------------------------------------------------
+
+
+
+#ifndef Mqtt5Client_H
+#define Mqtt5Client_H
+
+#include <Arduino.h>
+#include <Client.h>
+// connection state codes (MQTT_CONNECTED, MQTT_CONNECTION_TIMEOUT, ...) are shared with PubSubClient
+#include <PubSubClient.h>
+
+// Outbound topic aliases kept per connection, also the inbound maximum announced to the broker
+#ifndef MQTT5_MAX_TOPIC_ALIASES
+#define MQTT5_MAX_TOPIC_ALIASES 8
+#endif
+
+// Inbound packet buffer, announced to the broker as Maximum Packet Size
+#ifndef MQTT5_BUFFER_SIZE
+#define MQTT5_BUFFER_SIZE 512
+#endif
+
+// QoS 1 messages the broker may send us without acknowledgement (Receive Maximum)
+#ifndef MQTT5_RECEIVE_MAXIMUM
+#define MQTT5_RECEIVE_MAXIMUM 8
+#endif
+
+struct ArMqtt5Stats {
+	uint16_t topicAliasMaximum;		// outbound aliases allowed by the broker
+	uint16_t receiveMaximum;		// unacknowledged QoS 1 messages allowed by the broker
+	uint16_t inflight;				// QoS 1 messages waiting for PUBACK
+	uint32_t aliasedMessages;		// messages sent with an already known topic alias
+	uint32_t aliasBytesSaved;		// bytes not sent thanks to topic aliases, net of the messages defining them
+};
+
+// Minimal MQTT 5 client with the same shape as PubSubClient.
+// Supports QoS 0 subscriptions, QoS 0 / 1 publish, inbound and outbound topic aliases,
+// message expiry and the broker's Receive Maximum for outgoing QoS 1 messages.
+class Mqtt5Client : public Print {
+public:
+	typedef std::function<void(char*, uint8_t*, unsigned int)> CallbackFunction;
+private:
+	Client* _client = nullptr;
+	const char* _host = nullptr;
+	uint16_t _port = 1883;
+	CallbackFunction _callback;
+	uint8_t _buffer[MQTT5_BUFFER_SIZE];
+	size_t _received = 0;
+	size_t _packetLength = 0;
+	size_t _headerLength = 0;
+	uint32_t _multiplier = 1;
+	uint32_t _remaining = 0;
+
+	uint16_t _keepAlive = MQTT_KEEPALIVE;
+	uint32_t _lastInActivity = 0;
+	uint32_t _lastOutActivity = 0;
+	bool _pingOutstanding = false;
+	int _state = MQTT_DISCONNECTED;
+	uint16_t _nextPacketId = 1;
+	uint16_t _inflight = 0;
+	uint32_t _messageExpiry = 0;
+
+	// limits from CONNACK
+	uint16_t _serverAliasMaximum = 0;
+	uint16_t _serverReceiveMaximum = 0xFFFF;
+	uint32_t _serverMaximumPacketSize = 0;
+	int32_t _serverKeepAlive = -1;
+
+	const char* _aliases[MQTT5_MAX_TOPIC_ALIASES];
+	String _inboundAliases[MQTT5_MAX_TOPIC_ALIASES];	// any length, the memory is reused when the broker redefines an alias
+	uint32_t _aliasedMessages = 0;
+	int32_t _aliasBytesSaved = 0;	// negative until the aliases paid for their definition
+
+	static size_t encodeLength(uint8_t* out, uint32_t length);
+	static bool readLength(const uint8_t*& pos, const uint8_t* end, uint32_t& length);
+	static bool readProperty(const uint8_t*& pos, const uint8_t* end, uint8_t& id, uint32_t& value);
+	bool readPacket();
+	void resetRead();
+	void handlePacket();
+	void handlePublish();
+	bool writeAll(const uint8_t* data, size_t length, bool progmem = false);
+	void clearAliases();
+	uint16_t nextPacketId();
+public:
+	Mqtt5Client();
+	Mqtt5Client& setClient(Client& client) {
+		_client = &client;
+		return *this;
+	}
+	Mqtt5Client& setServer(const char* host, uint16_t port) {
+		_host = host;
+		_port = port;
+		return *this;
+	}
+	Mqtt5Client& setCallback(CallbackFunction callback) {
+		_callback = callback;
+		return *this;
+	}
+	// never above the broker's Server Keep Alive while connected
+	Mqtt5Client& setKeepAlive(uint16_t keepAlive) {
+		if (_state == MQTT_CONNECTED && _serverKeepAlive >= 0 && keepAlive > _serverKeepAlive)
+			keepAlive = _serverKeepAlive;
+		_keepAlive = keepAlive;
+		return *this;
+	}
+	// Server Keep Alive from CONNACK in seconds, -1 when the broker accepted ours
+	int32_t getServerKeepAlive() const {
+		return _serverKeepAlive;
+	}
+	// Message Expiry Interval in seconds sent with every publish, 0 never expires
+	void setMessageExpiry(uint32_t seconds) {
+		_messageExpiry = seconds;
+	}
+	bool connect(const char* id, const char* user, const char* pass);
+	void disconnect();
+	bool connected();
+	int state() {
+		return _state;
+	}
+	bool loop();
+	// false when not connected, the packet is too big for the broker or (QoS 1) Receive Maximum is reached
+	bool publish(const char* topic, const uint8_t* payload, unsigned int plength, bool retained, uint8_t qos = 0, bool useAlias = false, bool progmem = false);
+	bool canPublishQos1() const {
+		return _inflight < _serverReceiveMaximum;
+	}
+
+	// Topic alias for topic, 0 when none can be used. When isNew the broker learns it from this message.
+	// Only call commitAlias() once the message is really going to be sent.
+	uint16_t prepareAlias(const char* topic, bool& isNew);
+	void commitAlias(const char* topic, uint16_t alias, bool isNew);
+	// topic is about to be freed, its alias may be given to another topic
+	void releaseAlias(const char* topic);
+	// PUBLISH properties for topic (alias, message expiry), returns their length (at most 8 bytes)
+	size_t buildPublishProperties(uint16_t alias, uint8_t* properties);
+
+	ArMqtt5Stats getStats();
+
+	size_t write(uint8_t b) override;
+	size_t write(const uint8_t* buffer, size_t size) override;
+};
+#endif
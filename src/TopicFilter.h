@@ -0,0 +1,47 @@
+ //------------------------------------------------------------------
+ // Copyright(c) 2022-2024 a2n Technology
+ // Anwar Minarso (anwar.minarso@gmail.com)
+ // https://github.com/anwarminarso/
+ // This file is part of the a2n ESPWiFiMqttWrapper v1.0.6
+ //
+ // This library is free software; you can redistribute it and/or
+ // modify it under the terms of the GNU Lesser General Public
+ // License as published by the Free Software Foundation; either
+ // version 2.1 of the License, or (at your option) any later version.
+ //
+ // This library is distributed in the hope that it will be useful,
+ // but WITHOUT ANY WARRANTY; without even the implied warranty of
+ // MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the GNU
+ // Lesser General Public License for more details
+ //------------------------------------------------------------------
+
+
+#ifndef TopicFilter_H
+#define TopicFilter_H
+
+#include <Arduino.h>
+
+// MQTT topic filter matching with '+' (single level) and '#' (multi level) wildcards.
+// "a/#" also matches "a", and wildcards at the first level never match "$SYS" style topics.
+inline bool topicMatches(const char* filter, const char* topic) {
+	if (*topic == '$' && (*filter == '+' || *filter == '#'))
+		return false;
+	while (*filter) {
+		if (*filter == '#')
+			return true;
+		if (*filter == '+') {
+			while (*topic && *topic != '/')
+				topic++;
+			filter++;
+		}
+		else if (*filter == *topic) {
+			filter++;
+			topic++;
+		}
+		else {
+			return *topic == '\0' && strcmp(filter, "/#") == 0;
+		}
+	}
+	return *topic == '\0';
+}
+#endif
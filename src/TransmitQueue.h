@@ -0,0 +1,276 @@
+ //------------------------------------------------------------------
+ // Copyright(c) 2022-2024 a2n Technology
+ // Anwar Minarso (anwar.minarso@gmail.com)
+ // https://github.com/anwarminarso/
+ // This file is part of the a2n ESPWiFiMqttWrapper v1.0.6
+ //
+ // This library is free software; you can redistribute it and/or
+ // modify it under the terms of the GNU Lesser General Public
+ // License as published by the Free Software Foundation; either
+ // version 2.1 of the License, or (at your option) any later version.
+ //
+ // This library is distributed in the hope that it will be useful,
+ // but WITHOUT ANY WARRANTY; without even the implied warranty of
+ // MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the GNU
+ // Lesser General Public License for more details
+ //------------------------------------------------------------------
+
+
+#ifndef TransmitQueue_H
+#define TransmitQueue_H
+
+#include <Arduino.h>
+
+// Bytes written per loop() when the client cannot report free socket space
+#ifndef TRANSMIT_QUEUE_CHUNK
+#define TRANSMIT_QUEUE_CHUNK 256
+#endif
+
+enum ArPublishResult {
+	PUBLISH_SENT = 0,		// written directly to the connection (transmit queue disabled)
+	PUBLISH_QUEUED,			// accepted, will be written from loop()
+	PUBLISH_WOULD_BLOCK,	// queue has no room for this packet right now, try again later
+	PUBLISH_DROPPED			// packet can never be sent (bigger than the queue, or not connected)
+};
+
+// param1: true when the queue rises above the mark, false when it drained below half of it
+// param2: bytes queued
+// param3: queue capacity
+typedef std::function<void(bool, size_t, size_t)> ArTransmitHighWaterFunction;
+
+// Bounded ring buffer of encoded MQTT PUBLISH packets (QoS 0).
+// Packets are accepted whole or not at all, and written out only as fast
+// as the socket accepts them, so a partially written packet is kept until
+// the next loop().
+class TransmitQueue {
+private:
+	uint8_t* _buffer = nullptr;
+	size_t _capacity = 0;
+	size_t _head = 0;
+	size_t _tail = 0;
+	size_t _used = 0;
+	size_t _packetRemaining = 0;
+	size_t _highWaterMark = 0;
+	bool _aboveHighWater = false;
+	uint32_t _dropped = 0;
+	ArTransmitHighWaterFunction _onHighWater;
+
+	void push(const uint8_t* data, size_t length, bool progmem) {
+		while (length > 0) {
+			size_t chunk = _capacity - _head;
+			if (chunk > length)
+				chunk = length;
+			if (progmem)
+				memcpy_P(_buffer + _head, data, chunk);
+			else
+				memcpy(_buffer + _head, data, chunk);
+			_head = (_head + chunk) % _capacity;
+			_used += chunk;
+			data += chunk;
+			length -= chunk;
+		}
+	}
+	uint8_t at(size_t pos, size_t offset) const {
+		return _buffer[(pos + offset) % _capacity];
+	}
+	// length of the packet starting at pos
+	size_t packetLength(size_t pos, size_t& headerLength) const {
+		// fixed header: 1 byte type/flags followed by 1-4 bytes remaining length
+		size_t remaining = 0;
+		size_t multiplier = 1;
+		headerLength = 1;
+		uint8_t encoded;
+		do {
+			encoded = at(pos, headerLength);
+			remaining += (encoded & 0x7F) * multiplier;
+			multiplier <<= 7;
+			headerLength++;
+		} while ((encoded & 0x80) && headerLength < 5);
+		return headerLength + remaining;
+	}
+	size_t peekPacketLength() const {
+		size_t headerLength;
+		return packetLength(_tail, headerLength);
+	}
+	// MQTT 5 packet at pos carries a Topic Alias property (or one this queue does not know)
+	bool hasTopicAlias(size_t pos, size_t headerLength) const {
+		size_t offset = headerLength;
+		offset += 2 + ((size_t)at(pos, offset) << 8 | at(pos, offset + 1));
+		size_t end = offset + 1 + at(pos, offset);
+		for (offset++; offset < end;) {
+			switch (at(pos, offset)) {
+			case 0x02:	// Message Expiry Interval
+				offset += 5;
+				break;
+			default:	// 0x23 Topic Alias
+				return true;
+			}
+		}
+		return false;
+	}
+	void skip(size_t length) {
+		_tail = (_tail + length) % _capacity;
+		_used -= length;
+	}
+	void checkHighWater() {
+		if (!_highWaterMark)
+			return;
+		if (!_aboveHighWater && _used >= _highWaterMark) {
+			_aboveHighWater = true;
+			if (_onHighWater)
+				_onHighWater(true, _used, _capacity);
+		}
+		else if (_aboveHighWater && _used < _highWaterMark / 2) {
+			_aboveHighWater = false;
+			if (_onHighWater)
+				_onHighWater(false, _used, _capacity);
+		}
+	}
+public:
+	TransmitQueue() {}
+	~TransmitQueue() {
+		::free(_buffer);
+	}
+	bool begin(size_t capacity) {
+		::free(_buffer);
+		_buffer = nullptr;
+		_capacity = 0;
+		_head = _tail = _used = _packetRemaining = 0;
+		_aboveHighWater = false;
+		if (capacity == 0)
+			return true;
+		_buffer = (uint8_t*)malloc(capacity);
+		if (!_buffer)
+			return false;
+		_capacity = capacity;
+		return true;
+	}
+	void setHighWaterMark(size_t level, ArTransmitHighWaterFunction func) {
+		_highWaterMark = level;
+		_onHighWater = func;
+		_aboveHighWater = false;
+		checkHighWater();
+	}
+	bool isEnabled() const {
+		return _buffer != nullptr;
+	}
+	// true when no packet is half written, so other writers may use the socket
+	bool isIdle() const {
+		return _packetRemaining == 0;
+	}
+	size_t used() const {
+		return _used;
+	}
+	size_t capacity() const {
+		return _capacity;
+	}
+	uint32_t dropped() const {
+		return _dropped;
+	}
+	// properties: MQTT 5 PUBLISH properties (at most 127 bytes), nullptr for MQTT 3.1.1
+	ArPublishResult enqueue(const char* topic, const uint8_t* payload, unsigned int plength, bool retained, bool progmem = false,
+		const uint8_t* properties = nullptr, uint8_t propertiesLength = 0) {
+		size_t topicLength = strlen(topic);
+		size_t remaining = 2 + topicLength + plength;
+		if (properties)
+			remaining += 1 + propertiesLength;
+		uint8_t header[5];
+		size_t headerLength = 1;
+		header[0] = retained ? 0x31 : 0x30;
+		size_t len = remaining;
+		do {
+			uint8_t encoded = len & 0x7F;
+			len >>= 7;
+			if (len > 0)
+				encoded |= 0x80;
+			header[headerLength++] = encoded;
+		} while (len > 0 && headerLength < 5);
+
+		size_t total = headerLength + remaining;
+		if (!_buffer || topicLength > 0xFFFF || propertiesLength > 127 || len > 0 || total > _capacity) {
+			_dropped++;
+			return PUBLISH_DROPPED;
+		}
+		if (total > _capacity - _used)
+			return PUBLISH_WOULD_BLOCK;
+
+		uint8_t topicLengthBytes[2] = { (uint8_t)(topicLength >> 8), (uint8_t)(topicLength & 0xFF) };
+		push(header, headerLength, false);
+		push(topicLengthBytes, 2, false);
+		push((const uint8_t*)topic, topicLength, false);
+		if (properties) {
+			uint8_t length = propertiesLength;
+			push(&length, 1, false);
+			push(properties, propertiesLength, false);
+		}
+		push(payload, plength, progmem);
+		checkHighWater();
+		return PUBLISH_QUEUED;
+	}
+	// writes at most room bytes to out, returns the number of bytes written
+	size_t drain(Print& out, size_t room) {
+		size_t sent = 0;
+		while (_used > 0 && room > 0) {
+			if (_packetRemaining == 0)
+				_packetRemaining = peekPacketLength();
+			size_t chunk = _packetRemaining;
+			if (chunk > _capacity - _tail)
+				chunk = _capacity - _tail;
+			if (chunk > room)
+				chunk = room;
+			size_t written = out.write(_buffer + _tail, chunk);
+			if (written > chunk)
+				written = chunk;
+			skip(written);
+			_packetRemaining -= written;
+			room -= written;
+			sent += written;
+			if (written < chunk)
+				break;
+		}
+		checkHighWater();
+		return sent;
+	}
+	// the broker never saw the start of this packet on a new connection, drop the rest of it
+	void discardPartial() {
+		if (_packetRemaining == 0)
+			return;
+		skip(_packetRemaining);
+		_packetRemaining = 0;
+		_dropped++;
+		checkHighWater();
+	}
+	// MQTT 5 reconnect: topic aliases died with the old connection, drop the packets using them.
+	// Every other packet is kept in order.
+	void discardAliased() {
+		discardPartial();
+		size_t read = _tail;
+		size_t write = _tail;
+		size_t left = _used;
+		while (left > 0) {
+			size_t headerLength;
+			size_t length = packetLength(read, headerLength);
+			if (hasTopicAlias(read, headerLength)) {
+				_used -= length;
+				_dropped++;
+			}
+			else {
+				// write never overtakes read, copying forward is safe
+				if (write != read) {
+					for (size_t i = 0; i < length; i++)
+						_buffer[(write + i) % _capacity] = _buffer[(read + i) % _capacity];
+				}
+				write = (write + length) % _capacity;
+			}
+			read = (read + length) % _capacity;
+			left -= length;
+		}
+		_head = write;
+		checkHighWater();
+	}
+	void clear() {
+		_head = _tail = _used = _packetRemaining = 0;
+		checkHighWater();
+	}
+};
+#endif
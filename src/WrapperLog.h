@@ -0,0 +1,145 @@
+ //------------------------------------------------------------------
+ // Copyright(c) 2022-2024 a2n Technology
+ // Anwar Minarso (anwar.minarso@gmail.com)
+ // https://github.com/anwarminarso/
+ // This file is part of the a2n ESPWiFiMqttWrapper v1.0.6
+ //
+ // This library is free software; you can redistribute it and/or
+ // modify it under the terms of the GNU Lesser General Public
+ // License as published by the Free Software Foundation; either
+ // version 2.1 of the License, or (at your option) any later version.
+ //
+ // This library is distributed in the hope that it will be useful,
+ // but WITHOUT ANY WARRANTY; without even the implied warranty of
+ // MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the GNU
+ // Lesser General Public License for more details
+ //------------------------------------------------------------------
+
+
+#ifndef WrapperLog_H
+#define WrapperLog_H
+
+#include <Arduino.h>
+
+#define ESPWIFIMQTT_LOG_NONE	0
+#define ESPWIFIMQTT_LOG_ERROR	1
+#define ESPWIFIMQTT_LOG_WARN	2
+#define ESPWIFIMQTT_LOG_INFO	3
+#define ESPWIFIMQTT_LOG_DEBUG	4
+
+// Compile time log level, statements above this level are not compiled at all.
+// Override with a build flag, e.g. -DESPWIFIMQTT_LOG_LEVEL=ESPWIFIMQTT_LOG_NONE
+#ifndef ESPWIFIMQTT_LOG_LEVEL
+#define ESPWIFIMQTT_LOG_LEVEL ESPWIFIMQTT_LOG_INFO
+#endif
+
+// Longest formatted log line, longer lines are truncated
+#ifndef ESPWIFIMQTT_LOG_LINE
+#define ESPWIFIMQTT_LOG_LINE 128
+#endif
+
+// Only usable inside ESPWiFiMqttWrapper members, the format string stays in flash
+#if ESPWIFIMQTT_LOG_LEVEL >= ESPWIFIMQTT_LOG_ERROR
+#define WRAPPER_LOGE(format, ...) this->log(PSTR(format "\r\n"), ##__VA_ARGS__)
+#else
+#define WRAPPER_LOGE(format, ...) do {} while (0)
+#endif
+#if ESPWIFIMQTT_LOG_LEVEL >= ESPWIFIMQTT_LOG_WARN
+#define WRAPPER_LOGW(format, ...) this->log(PSTR(format "\r\n"), ##__VA_ARGS__)
+#else
+#define WRAPPER_LOGW(format, ...) do {} while (0)
+#endif
+#if ESPWIFIMQTT_LOG_LEVEL >= ESPWIFIMQTT_LOG_INFO
+#define WRAPPER_LOGI(format, ...) this->log(PSTR(format "\r\n"), ##__VA_ARGS__)
+#else
+#define WRAPPER_LOGI(format, ...) do {} while (0)
+#endif
+#if ESPWIFIMQTT_LOG_LEVEL >= ESPWIFIMQTT_LOG_DEBUG
+#define WRAPPER_LOGD(format, ...) this->log(PSTR(format "\r\n"), ##__VA_ARGS__)
+#else
+#define WRAPPER_LOGD(format, ...) do {} while (0)
+#endif
+
+// In RAM log sink. Writing never blocks; when full the oldest text is overwritten.
+// The content is written to a Stream later, either from loop() or on demand.
+class LogRingBuffer {
+private:
+	char* _buffer = nullptr;
+	size_t _capacity = 0;
+	size_t _head = 0;
+	size_t _tail = 0;
+	size_t _used = 0;
+	uint32_t _lost = 0;
+public:
+	LogRingBuffer() {}
+	~LogRingBuffer() {
+		::free(_buffer);
+	}
+	bool begin(size_t capacity) {
+		::free(_buffer);
+		_buffer = nullptr;
+		_capacity = _head = _tail = _used = 0;
+		if (capacity == 0)
+			return true;
+		_buffer = (char*)malloc(capacity);
+		if (!_buffer)
+			return false;
+		_capacity = capacity;
+		return true;
+	}
+	bool isEnabled() const {
+		return _buffer != nullptr;
+	}
+	size_t used() const {
+		return _used;
+	}
+	// bytes overwritten before they could be written out
+	uint32_t lost() const {
+		return _lost;
+	}
+	void write(const char* text, size_t length) {
+		if (length > _capacity) {
+			_lost += length - _capacity;
+			text += length - _capacity;
+			length = _capacity;
+		}
+		if (length > _capacity - _used) {
+			size_t overflow = length - (_capacity - _used);
+			_tail = (_tail + overflow) % _capacity;
+			_used -= overflow;
+			_lost += overflow;
+		}
+		while (length > 0) {
+			size_t chunk = _capacity - _head;
+			if (chunk > length)
+				chunk = length;
+			memcpy(_buffer + _head, text, chunk);
+			_head = (_head + chunk) % _capacity;
+			_used += chunk;
+			text += chunk;
+			length -= chunk;
+		}
+	}
+	// writes at most maxBytes to out, returns the number of bytes written
+	size_t drain(Print& out, size_t maxBytes) {
+		size_t sent = 0;
+		while (_used > 0 && maxBytes > 0) {
+			size_t chunk = _capacity - _tail;
+			if (chunk > _used)
+				chunk = _used;
+			if (chunk > maxBytes)
+				chunk = maxBytes;
+			size_t written = out.write((const uint8_t*)_buffer + _tail, chunk);
+			if (written > chunk)
+				written = chunk;
+			_tail = (_tail + written) % _capacity;
+			_used -= written;
+			maxBytes -= written;
+			sent += written;
+			if (written < chunk)
+				break;
+		}
+		return sent;
+	}
+};
+#endif